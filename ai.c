@@ -1,8 +1,18 @@
 #include <limits.h>
+#include <math.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
 #include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
 
 #include "ai.h"
 #include "log.h"
+#include "picker.h"
+#include "tt.h"
 
 const int value_pawn   = 1000;
 const int value_knight = 3000;
@@ -11,105 +21,1388 @@ const int value_rook   = 5000;
 const int value_queen  = 9000;
 const int value_king   = 200000;
 const int value_move   = 50; // the more, the more positional is playing
+const int value_delta = 2000; // positional gain a capture may bring beyond the material
+const int value_infinite = 1000000; // beyond any score, bounds the full window
 
-const enum piece promotions[] = {
-    EMPTY,
-    KNIGHT,
-    BISHOP,
-    ROOK,
-    QUEEN,
+const int default_depth = 4; // when neither time nor depth is limited
+const int max_depth_limit = 64;
+const int default_moves_to_go = 30; // expected moves to the next time control
+const int clock_check_interval = 1024; // nodes between clock checks, a power of two
+const int null_move_min_depth = 3;
+const int null_move_verification_depth = 12; // verify the null move cutoffs from here on
+const int reduction_min_depth = 3;
+const int late_move_max_depth = 4; // prune the late quiet moves up to this depth
+const int history_per_ply = HISTORY_MAX / 4; // history worth a ply less or more reduction
+const int probcut_min_depth = 5;
+const int probcut_margin = 1700; // above beta
+const int probcut_reduction = 4;
+const int singular_min_depth = 8;
+const int singular_margin = value_pawn / 50; // per ply of depth
+const int aspiration_min_depth = 4;
+const int aspiration_window = 250; // initial half width, widened twice on each failure
+const int split_min_depth = 5; // deeper than late move pruning and futility pruning
+const int record_min_depth = 3; // of the entries a task hands over to its owner
+
+int perft; // Number of leaf positions searched by the last search, all threads together
+int move_overhead = 30; // milliseconds lost on communication per move
+int search_threads = 1;
+enum parallel_mode parallel_mode = PARALLEL_LAZY_SMP;
+
+// Pruning margins by depth, settable for tuning; index 0 is unused
+int reverse_futility_margins[REVERSE_FUTILITY_DEPTH + 1] = { 0, 900, 1700, 2500, 3300, 4100, 4900 };
+int futility_margins[FUTILITY_DEPTH + 1] = { 0, 1500, 2600, 3800 };
+int razoring_margins[RAZORING_DEPTH + 1] = { 0, 3000, 4500 };
+
+// Budgets of the current search in milliseconds, 0 for none
+struct clock_limits {
+    int soft;
+    int hard;
+    long long node_limit;
+} clock_limits;
+
+long long search_start;
+atomic_bool stopped; // the hard limit is reached, all the threads unwind
+int search_max_depth; // of the current search
+atomic_int idle_threads; // looking for tasks to steal
+
+int reductions[64][64]; // late move reductions by depth and move number, from ai_init()
+
+/*
+ * Triangular array of the principal variations: the best line found from
+ * each ply of the current line, made of the child ply's line and the move
+ * leading to it.
+ */
+struct principal_variation {
+    encoded_move moves[MAX_PLY][MAX_PLY]; // [ply][ply..length[ply]-1]
+    int length[MAX_PLY];
 };
 
-int perft; // Number of positions at the specified depth. Not thread safe.
+// A transposition table entry stored by a task, to be stored again by the owner
+struct table_record {
+    uint64_t key;
+    encoded_move move;
+    int score;
+    int depth;
+    enum tt_bound bound;
+};
+
+#define MAX_TASK_RECORDS 4096
+
+/*
+ * Everything a search changes while searching: its own copy of the position,
+ * the move ordering it learns and its search stack. Each thread searches
+ * in a context of its own; with split points, each task it runs gets
+ * one more, nested. Only the transposition table and the stop flag
+ * are shared by the threads.
+ */
+struct search_context {
+    struct search_thread *thread; // running the search
+    int nesting; // 0 for the thread's own context, one more for each split point above
+    struct split_point *split; // whose task is searched, NULL for the thread's own context
+    int task_index;
+    struct transposition_table table; // of a task in the deterministic mode
+    struct transposition_table *private_table; // stored to instead of the shared one, or NULL
+    struct table_record *records; // deep entries of the private table, in order
+    int record_count;
+    struct game game;
+    struct history history; // of the game copy
+    long long nodes; // positions searched, including the completed tasks split off
+    int leaves; // positions searched by quiescence, likewise
+    struct heuristics heuristics;
+    struct principal_variation pv;
+    encoded_move excluded_moves[MAX_PLY]; // skipped by the singular extension search at each ply
+    int null_move_min_ply; // no null moves above it, while a null move cutoff is verified
+    int root_depth; // of the current iteration, bounds the extensions
+
+    // results of the last completed iteration
+    int completed_depth;
+    int score;
+    encoded_move best;
+    encoded_move pv_line[MAX_PLY];
+    int pv_line_length;
+};
+
+/*
+ * Bounds the memory of a search thread, besides the Hash table: up to 15
+ * nested task contexts of 178 KB, about 2.7 MB, with the Work Stealing
+ * search, and 6.7 MB with the Deterministic one, adding 96 KB of records
+ * to each and 2.6 MB of task tables in all.
+ */
+#define MAX_NESTING 16 // of the split points above a task
+#define MAX_QUEUED_TASKS 4096
+#define TASK_TABLE_SIZE 1024 // kilobytes, for the tasks of the outermost split points
+#define MIN_TASK_TABLE_SIZE 64 // kilobytes
+
+/*
+ * A search thread and its task deque: the thread pushes the tasks of its
+ * split points and pops them at the bottom, the others steal at the top.
+ */
+struct search_thread {
+    int id; // 0 for the main thread, which keeps the clock and reports
+    pthread_t thread;
+    _Atomic long long nodes; // positions searched in all its contexts, read by the main thread
+    struct search_context *contexts[MAX_NESTING]; // by nesting, allocated when first needed
+    pthread_mutex_t lock; // of the deque
+    struct task *tasks[MAX_QUEUED_TASKS];
+    int top;
+    int bottom;
+};
+
+struct search_thread *threads; // from set_threads()
+
+enum task_state {
+    TASK_QUEUED,
+    TASK_DONE,
+    TASK_ABORTED, // made useless by a cutoff, or stopped
+};
+
+// A move of a split point, searched by whichever thread gets it
+struct task {
+    struct split_point *split;
+    int index; // in the move order, the first after the eldest brother is 0
+    encoded_move move;
+    int move_count; // of the move in the node, for late move reductions
+    int history;
+    enum task_state state;
+    int score;
+    long long nodes;
+    int leaves;
+    int line_length; // of the principal variation below the move, at PV nodes
+    struct table_record *records; // stored by the task in the deterministic mode, or NULL
+    int record_count;
+};
+
+/*
+ * A node whose moves after the eldest brother are searched in parallel.
+ * It lives in the stack of the owner, which waits for all its tasks.
+ */
+struct split_point {
+    struct search_context *owner; // searching the node, unchanged until the tasks are done
+    int depth;
+    int ply;
+    int alpha_fixed; // after the eldest brother
+    _Atomic int alpha; // raised by the tasks, unless deterministic
+    int beta;
+    _Atomic int cutoff; // tasks after this index are aborted
+    _Atomic int pending; // tasks not done nor aborted
+    encoded_move (*lines)[MAX_PLY]; // principal variations by task, at PV nodes, or NULL
+    int task_count;
+    struct task tasks[MAX_MOVES];
+};
+
+void (*report_iteration)(int depth, int score, long long nodes, long long time,
+                         const encoded_move *pv, int pv_length);
+
+static inline int min(int a, int b)
+{
+    return a < b ? a : b;
+}
+
+static inline int max(int a, int b)
+{
+    return a > b ? a : b;
+}
+
+/*
+ * Memory of a thread's nested contexts in the deterministic mode: each
+ * nesting's tasks get a table half as large as the one above, as their
+ * trees are smaller, so all of them take less than twice the outermost.
+ * The size depends on the nesting only, not on the number of threads,
+ * so that the tree searched does not either.
+ */
+static inline int task_table_size(int nesting)
+{
+    return max(TASK_TABLE_SIZE >> min(nesting - 1, 16), MIN_TASK_TABLE_SIZE);
+}
+
+// Wall clock in milliseconds
+long long now()
+{
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+long long elapsed()
+{
+    return now() - search_start;
+}
+
+// Positions searched by all the threads
+long long total_nodes()
+{
+    long long total = 0;
+    for (int i = 0; i < search_threads; i++)
+        total += atomic_load_explicit(&threads[i].nodes, memory_order_relaxed);
+    return total;
+}
+
+// Called by the main thread every clock_check_interval nodes, and while it waits
+// for stolen tasks, to stop the search at the hard limit
+void check_clock()
+{
+    if ((clock_limits.hard > 0 && elapsed() >= clock_limits.hard) ||
+            (clock_limits.node_limit > 0 && total_nodes() >= clock_limits.node_limit))
+        stopped = true;
+}
+
+// Only the thread itself writes its node count, the others may read it
+static inline void count_node(struct search_context *ctx)
+{
+    ctx->nodes++;
+    struct search_thread *thread = ctx->thread;
+    long long nodes = atomic_load_explicit(&thread->nodes, memory_order_relaxed) + 1;
+    atomic_store_explicit(&thread->nodes, nodes, memory_order_relaxed);
+    if (thread->id == 0 && (nodes & (clock_check_interval - 1)) == 0)
+        check_clock();
+}
+
+// Nodes to report: the deterministic mode counts only the tree it would search in any run
+long long searched_nodes(const struct search_context *ctx)
+{
+    return parallel_mode == PARALLEL_DETERMINISTIC ? ctx->nodes : total_nodes();
+}
+
+/*
+ * Should the search unwind? When stopped, or when a sibling of the task,
+ * or of a task above it, has caused a cutoff.
+ */
+bool halted(const struct search_context *ctx)
+{
+    if (stopped)
+        return true;
+    for (; ctx->split != NULL; ctx = ctx->split->owner)
+        if (ctx->task_index > atomic_load_explicit(&ctx->split->cutoff, memory_order_relaxed))
+            return true;
+    return false;
+}
+
+/*
+ * The transposition table of the search. Tasks of the deterministic mode
+ * store to their private tables, and read those of the tasks they are
+ * nested in and the shared one, none of which is written while they run:
+ * what a task finds does not depend on what the other threads happen
+ * to have searched. The deep entries a task stores are recorded, for
+ * the owner to store again when it takes the task's result.
+ */
+bool probe(struct search_context *ctx, struct tt_data *data)
+{
+    for (const struct search_context *c = ctx; c->private_table != NULL; c = c->split->owner)
+        if (table_probe(c->private_table, ctx->game.hash, data))
+            return true;
+    return tt_probe(ctx->game.hash, data);
+}
+
+void store_key(struct search_context *ctx, uint64_t key, encoded_move move, int score, int depth,
+               enum tt_bound bound)
+{
+    if (ctx->private_table == NULL) {
+        tt_store(key, move, score, depth, bound);
+        return;
+    }
+    table_store(ctx->private_table, key, move, score, depth, bound);
+    if (depth >= record_min_depth && ctx->record_count < MAX_TASK_RECORDS)
+        ctx->records[ctx->record_count++] = (struct table_record){ key, move, score, depth, bound };
+}
+
+void store(struct search_context *ctx, encoded_move move, int score, int depth,
+           enum tt_bound bound)
+{
+    store_key(ctx, ctx->game.hash, move, score, depth, bound);
+}
 
 int evaluate(struct game *game, enum piece color)
 {
-    enum piece actual_side_to_move = game->side_to_move;
-    game->side_to_move = color;
     int result = 0;
 
-    struct square square;
-    break_debugger();
-    for (square.file = 0; square.file < 8; square.file++)
-    for (square.rank = 0; square.rank < 8; square.rank++) {
-        int piece_value = 0;
-        const enum piece piece = piece_at(game, square);
-        if ((piece == EMPTY) || (piece & COLOR != color))
-            continue;
-        enum piece piece_type = piece & PIECE_TYPE;
+    // material, from the piece counts kept by the game
+    const uint8_t *count = game->piece_count[color_index(color)];
+    result += count[type_index(PAWN)]   * value_pawn;
+    result += count[type_index(KNIGHT)] * value_knight;
+    result += count[type_index(BISHOP)] * value_bishop;
+    result += count[type_index(ROOK)]   * value_rook;
+    result += count[type_index(QUEEN)]  * value_queen;
 
-        switch (piece_type) {
-        case PAWN:   piece_value = value_pawn;   break;
-        case KNIGHT: piece_value = value_knight; break;
-        case BISHOP: piece_value = value_bishop; break;
-        case ROOK:   piece_value = value_rook;   break;
-        case QUEEN:  piece_value = value_queen;  break;
+    // count possible moves of the pieces, from the attack maps
+    bitboard own = game->colors[color_index(color)];
+    bitboard pieces = own & ~game->pieces[type_index(PAWN)] & ~game->pieces[type_index(KING)];
+    while (pieces)
+        result += popcount(game->attacks_from[pop_lsb(&pieces)] & ~own) * value_move;
+
+    return result;
+}
+
+int piece_value(enum piece type)
+{
+    switch (type & PIECE_TYPE) {
+    case PAWN:   return value_pawn;
+    case KNIGHT: return value_knight;
+    case BISHOP: return value_bishop;
+    case ROOK:   return value_rook;
+    case QUEEN:  return value_queen;
+    case KING:   return value_king;
+    default:     return 0;
+    }
+}
+
+// Material a capture or promotion wins, not counting the recapture
+int material_gain(const struct game *game, encoded_move m)
+{
+    int gain = move_type(m) == MOVE_EN_PASSANT ? value_pawn :
+            piece_value(game->mailbox[move_to(m)]);
+    if (move_type(m) == MOVE_PROMOTION)
+        gain += piece_value(move_promotion(m)) - value_pawn;
+    return gain;
+}
+
+/*
+ * Fill the search tables and set up one search thread. Must be called once
+ * at the program start.
+ */
+void ai_init()
+{
+    // the later the move and the deeper the search, the less the move matters
+    for (int depth = 1; depth < 64; depth++)
+    for (int move_count = 1; move_count < 64; move_count++)
+        reductions[depth][move_count] = (int)(0.75 + log(depth) * log(move_count) / 2.25);
+    set_threads(1);
+}
+
+// Quiet moves searched before the rest are pruned, by depth
+static inline int late_move_count(int depth)
+{
+    return 3 + depth * depth;
+}
+
+// The move beat alpha: it and the line below it are the best line from the ply
+void update_pv(struct search_context *ctx, int ply, encoded_move m)
+{
+    ctx->pv.moves[ply][ply] = m;
+    for (int i = ply + 1; i < ctx->pv.length[ply + 1]; i++)
+        ctx->pv.moves[ply][i] = ctx->pv.moves[ply + 1][i];
+    ctx->pv.length[ply] = max(ctx->pv.length[ply + 1], ply + 1);
+}
+
+// The move of the last iteration's principal variation, if the current line follows it
+encoded_move pv_move(const struct search_context *ctx, int ply)
+{
+    if (ply >= ctx->pv_line_length)
+        return NO_MOVE;
+    for (int i = 0; i < ply; i++)
+        if (ctx->heuristics.played[i] != ctx->pv_line[i])
+            return NO_MOVE;
+    return ctx->pv_line[ply];
+}
+
+// Evaluation from the point of view of the side to move
+int static_eval(struct game *game)
+{
+    return evaluate(game, game->side_to_move) - evaluate(game, opposite(game->side_to_move));
+}
+
+static inline bool is_mate_score(int score)
+{
+    return score >= value_king - MAX_PLY || score <= -value_king + MAX_PLY;
+}
+
+// Has the side to move pieces besides pawns and the king?
+bool has_pieces(const struct game *game)
+{
+    const uint8_t *count = game->piece_count[color_index(game->side_to_move)];
+    return count[type_index(KNIGHT)] + count[type_index(BISHOP)] +
+            count[type_index(ROOK)] + count[type_index(QUEEN)] > 0;
+}
+
+/*
+ * Mate scores count plies from the root, but the table is shared by all plies:
+ * store them counted from the position itself.
+ */
+int score_to_tt(int score, int ply)
+{
+    if (score >= value_king - MAX_PLY)
+        return score + ply;
+    if (score <= -value_king + MAX_PLY)
+        return score - ply;
+    return score;
+}
+
+int score_from_tt(int score, int ply)
+{
+    if (score >= value_king - MAX_PLY)
+        return score - ply;
+    if (score <= -value_king + MAX_PLY)
+        return score + ply;
+    return score;
+}
+
+/*
+ * Quiescence search: resolve the captures and promotions pending at the leaves
+ * before trusting the evaluation. The side to move may stand pat on the static
+ * score instead of capturing, unless in check: then all the evasions are
+ * searched and no evasion is mate. Captures which cannot raise the score
+ * to alpha even with a margin are pruned (delta pruning), and so are
+ * the captures losing material by the static exchange evaluation.
+ */
+int quiesce(struct search_context *ctx, int ply, int alpha, int beta)
+{
+    struct game *game = &ctx->game;
+    count_node(ctx);
+    if (halted(ctx))
+        return 0;
+    if (is_repetition(game, ply) || !enough_material(game))
+        return 0;
+    ctx->leaves++;
+
+    int stand_pat = static_eval(game);
+    if (ply >= MAX_PLY - 1)
+        return stand_pat;
+    int score_max = -value_infinite;
+    if (!game->checkers) {
+        if (stand_pat >= beta)
+            return stand_pat;
+        if (stand_pat > alpha)
+            alpha = stand_pat;
+        score_max = stand_pat;
+    }
+
+    // the picker hands out all the evasions in check, the captures otherwise
+    struct move_picker picker;
+    init_picker(&picker, game, &ctx->heuristics, NO_MOVE, ply, LEGAL|CAPTURES);
+    encoded_move m;
+    while ((m = next_move(&picker)) != NO_MOVE) {
+        if (!game->checkers && stand_pat + material_gain(game, m) + value_delta <= alpha)
+            continue; // cannot raise the score
+        struct undo undo;
+        ctx->heuristics.played[ply] = m;
+        make_move(game, m, &undo);
+        tt_prefetch(game->hash);
+        int score = -quiesce(ctx, ply + 1, -beta, -alpha);
+        unmake_move(game, m, &undo);
+        if (halted(ctx))
+            return 0;
+        if (score > score_max) {
+            score_max = score;
+            if (score > alpha)
+                alpha = score;
+            if (alpha >= beta)
+                break;
         }
+    }
+    if (score_max == -value_infinite)
+        return -value_king + ply; // no evasion
+    return score_max;
+}
+
+int search(struct search_context *ctx, int depth, int ply, int alpha, int beta);
+
+/*
+ * Make a move of the node at 'ply' and search it, by principal variation
+ * search: the first move is expected to be the best, the rest are only
+ * proved worse with a null window. Late move reductions: a quiet move
+ * coming late in the order is searched less deep, the less the worse its
+ * history. A move beating alpha is searched again, in full depth, then
+ * in full window. A quiet move not giving check is not searched if the node
+ * is futile: returns false then.
+ */
+bool search_move(struct search_context *ctx, encoded_move m, int depth, int ply, int alpha,
+                 int beta, int extension, int move_count, int history, bool futile, int *score)
+{
+    struct game *game = &ctx->game;
+    bool quiet = !is_capture(game, m);
+    struct undo undo;
+    ctx->heuristics.played[ply] = m;
+    make_move(game, m, &undo);
+    // check extension: a forcing move is seen to its consequences
+    if (ply < 2 * ctx->root_depth && game->checkers)
+        extension = 1;
+    int new_depth = depth - 1 + extension;
+    if (futile && quiet && move_count > 1 && !game->checkers) {
+        unmake_move(game, m, &undo);
+        return false;
+    }
+    tt_prefetch(game->hash);
 
-        // count possible moves
-        if (piece_type != PAWN && piece_type != KING) {
-            struct square to;
-            for (to.file = 0; to.file < 8; to.file++)
-            for (to.rank = 0; to.rank < 8; to.rank++)
-                if (is_legal_move(game, square, to, EMPTY) || is_legal_move(game, square, to, QUEEN))
-                    result += value_move;
+    if (move_count == 1) {
+        *score = -search(ctx, new_depth, ply + 1, -beta, -alpha);
+    } else {
+        int reduction = 0;
+        if (quiet && depth >= reduction_min_depth && !undo.checkers && !game->checkers) {
+            reduction = reductions[min(depth, 63)][min(move_count, 63)] -
+                    history / history_per_ply;
+            reduction = max(0, min(reduction, new_depth - 1));
         }
+        *score = -search(ctx, new_depth - reduction, ply + 1, -alpha - 1, -alpha);
+        if (*score > alpha && reduction > 0)
+            *score = -search(ctx, new_depth, ply + 1, -alpha - 1, -alpha);
+        if (*score > alpha && *score < beta)
+            *score = -search(ctx, new_depth, ply + 1, -beta, -alpha);
+    }
+    unmake_move(game, m, &undo);
+    return true;
+}
+
+/*
+ * Should the node split? In the work stealing mode when a thread is idle,
+ * in the deterministic mode always, so that the tree does not depend
+ * on the threads.
+ */
+bool can_split(const struct search_context *ctx, int depth)
+{
+    if (depth < split_min_depth || ctx->nesting + 1 >= MAX_NESTING)
+        return false;
+    return parallel_mode == PARALLEL_DETERMINISTIC || (parallel_mode == PARALLEL_WORK_STEALING &&
+            atomic_load_explicit(&idle_threads, memory_order_relaxed) > 0);
+}
+
+bool push_task(struct search_thread *thread, struct task *task)
+{
+    pthread_mutex_lock(&thread->lock);
+    bool pushed = thread->bottom < MAX_QUEUED_TASKS;
+    if (pushed)
+        thread->tasks[thread->bottom++] = task;
+    pthread_mutex_unlock(&thread->lock);
+    return pushed;
+}
+
+// The last task the thread pushed, if it belongs to the split point
+struct task* pop_task(struct search_thread *thread, const struct split_point *split)
+{
+    struct task *task = NULL;
+    pthread_mutex_lock(&thread->lock);
+    if (thread->bottom > thread->top && thread->tasks[thread->bottom - 1]->split == split)
+        task = thread->tasks[--thread->bottom];
+    if (thread->bottom == thread->top)
+        thread->top = thread->bottom = 0;
+    pthread_mutex_unlock(&thread->lock);
+    return task;
+}
 
-        result += piece_value;
+// The first task pushed by any other thread, the one of the biggest subtree
+struct task* steal_task(const struct search_thread *thief)
+{
+    for (int i = 1; i < search_threads; i++) {
+        struct search_thread *victim = &threads[(thief->id + i) % search_threads];
+        struct task *task = NULL;
+        pthread_mutex_lock(&victim->lock);
+        if (victim->top < victim->bottom)
+            task = victim->tasks[victim->top++];
+        if (victim->bottom == victim->top)
+            victim->top = victim->bottom = 0;
+        pthread_mutex_unlock(&victim->lock);
+        if (task != NULL)
+            return task;
     }
-    game->side_to_move = actual_side_to_move;
-    return result;
+    return NULL;
 }
 
 /*
- * Negamax search. Returns the score of the current position;
- * returns the best move in 'from' and 'to'.
+ * A context of the thread for the task, a copy of the owner's, the tables
+ * learnt by the owner included. NULL if out of memory.
  */
-int best_move(struct game *game, int depth,
-        struct square *best_from, struct square *best_to, enum piece *best_promotion)
+struct search_context* enter_task(struct search_thread *thread, const struct task *task)
+{
+    const struct search_context *owner = task->split->owner;
+    int nesting = owner->nesting + 1;
+    struct search_context *ctx = thread->contexts[nesting];
+    if (ctx == NULL) {
+        ctx = thread->contexts[nesting] = calloc(1, sizeof *ctx);
+        if (ctx == NULL) {
+            log_err("No memory for a search task");
+            return NULL;
+        }
+    }
+    if (parallel_mode == PARALLEL_DETERMINISTIC) {
+        if (ctx->records == NULL)
+            ctx->records = malloc(MAX_TASK_RECORDS * sizeof *ctx->records);
+        if (ctx->records == NULL ||
+                (ctx->table.buckets == NULL && !table_resize(&ctx->table,
+                                                             task_table_size(nesting)))) {
+            log_err("No memory for a search task");
+            return NULL;
+        }
+        ctx->table.forget_older = true;
+        table_new_age(&ctx->table); // empty for the task, without clearing it
+        ctx->private_table = &ctx->table;
+        ctx->record_count = 0;
+    } else {
+        ctx->private_table = NULL;
+    }
+
+    ctx->thread = thread;
+    ctx->nesting = nesting;
+    ctx->split = task->split;
+    ctx->task_index = task->index;
+    ctx->game = owner->game;
+    if (owner->game.history != NULL) {
+        ctx->history.count = owner->game.history->count;
+        memcpy(ctx->history.keys, owner->game.history->keys,
+               ctx->history.count * sizeof *ctx->history.keys);
+        ctx->game.history = &ctx->history;
+    }
+    ctx->nodes = 0;
+    ctx->leaves = 0;
+    ctx->heuristics = owner->heuristics;
+    memcpy(ctx->excluded_moves, owner->excluded_moves, sizeof ctx->excluded_moves);
+    ctx->null_move_min_ply = owner->null_move_min_ply;
+    ctx->root_depth = owner->root_depth;
+    ctx->pv_line_length = owner->pv_line_length;
+    memcpy(ctx->pv_line, owner->pv_line, ctx->pv_line_length * sizeof *ctx->pv_line);
+    return ctx;
+}
+
+/*
+ * Search the move of the task in a context of the thread. Within a split
+ * point, the deterministic mode searches every task with the window left
+ * by the eldest brother, and a cutoff aborts only the tasks after it;
+ * so the tasks the owner uses are searched alike in any run. Otherwise
+ * the window narrows as the tasks raise alpha, and a cutoff aborts all.
+ */
+void run_task(struct search_thread *thread, struct task *task)
 {
-    if (best_to != NULL) // root call
-        perft = 0;
+    struct split_point *split = task->split;
+    bool deterministic = parallel_mode == PARALLEL_DETERMINISTIC;
+    task->state = TASK_ABORTED;
+    bool wanted = task->index <= atomic_load_explicit(&split->cutoff, memory_order_relaxed) &&
+            !halted(split->owner);
+    struct search_context *ctx = wanted ? enter_task(thread, task) : NULL;
+    if (wanted && ctx == NULL)
+        stopped = true; // out of memory, the search cannot go on
 
-    if (depth == 0) {
-        perft++;
-        enum piece op_color = (game->side_to_move == WHITE) ? BLACK : WHITE;
-        return evaluate(game, game->side_to_move) - evaluate(game, op_color);
+    if (ctx != NULL) {
+        int alpha = deterministic ? split->alpha_fixed :
+                atomic_load_explicit(&split->alpha, memory_order_relaxed);
+        int score;
+        search_move(ctx, task->move, split->depth, split->ply, alpha, split->beta, 0,
+                    task->move_count, task->history, false, &score);
+        if (!halted(ctx)) {
+            task->state = TASK_DONE;
+            task->score = score;
+            task->nodes = ctx->nodes;
+            task->leaves = ctx->leaves;
+            if (ctx->private_table != NULL && ctx->record_count > 0) {
+                size_t size = ctx->record_count * sizeof *ctx->records;
+                task->records = malloc(size);
+                if (task->records != NULL) {
+                    memcpy(task->records, ctx->records, size);
+                    task->record_count = ctx->record_count;
+                }
+            }
+            if (split->lines != NULL) {
+                int ply = split->ply;
+                task->line_length = ctx->pv.length[ply + 1];
+                for (int i = ply + 1; i < task->line_length; i++)
+                    split->lines[task->index][i] = ctx->pv.moves[ply + 1][i];
+            }
+            if (!deterministic) {
+                int raised = atomic_load_explicit(&split->alpha, memory_order_relaxed);
+                while (score > raised &&
+                        !atomic_compare_exchange_weak(&split->alpha, &raised, score))
+                    ;
+            }
+            if (score >= split->beta) {
+                int cutoff = deterministic ? task->index : -1;
+                int current = atomic_load(&split->cutoff);
+                while (cutoff < current && !atomic_compare_exchange_weak(&split->cutoff, &current,
+                                                                         cutoff))
+                    ;
+            }
+        }
+    }
+    atomic_fetch_sub_explicit(&split->pending, 1, memory_order_release);
+}
+
+/*
+ * Young brothers wait: once the eldest brother, the first move, is searched
+ * without a cutoff, the rest of the moves become tasks that idle threads
+ * may steal. The owner searches the tasks left to it and waits for the
+ * stolen ones, then takes their results in the move order, as if it had
+ * searched them itself. Never inlined: the 16 KB split point must stay
+ * out of the stack frame of every search() call.
+ */
+__attribute__((noinline))
+void split(struct search_context *ctx, struct move_picker *picker, int depth, int ply,
+           int *alpha, int beta, int *score_max, encoded_move *best, encoded_move *quiets,
+           int *n_quiets)
+{
+    struct game *game = &ctx->game;
+    struct split_point point = {
+        .owner = ctx,
+        .depth = depth,
+        .ply = ply,
+        .alpha_fixed = *alpha,
+        .beta = beta,
+    };
+    atomic_init(&point.alpha, *alpha);
+    atomic_init(&point.cutoff, INT_MAX);
+
+    int color = color_index(game->side_to_move);
+    encoded_move m;
+    while ((m = next_move(picker)) != NO_MOVE) {
+        if (m == ctx->excluded_moves[ply])
+            continue;
+        point.tasks[point.task_count] = (struct task){
+            .split = &point,
+            .index = point.task_count,
+            .move = m,
+            .move_count = point.task_count + 2,
+            .history = ctx->heuristics.history[color][move_from(m)][move_to(m)],
+        };
+        point.task_count++;
+    }
+    if (point.task_count == 0)
+        return;
+    if (beta - *alpha > 1)
+        point.lines = malloc(point.task_count * sizeof *point.lines);
+    atomic_init(&point.pending, point.task_count);
+
+    // pushed last first: the owner searches them in order, thieves take the last ones
+    for (int i = point.task_count - 1; i >= 0; i--)
+        if (!push_task(ctx->thread, &point.tasks[i]))
+            run_task(ctx->thread, &point.tasks[i]);
+    while (atomic_load_explicit(&point.pending, memory_order_acquire) > 0) {
+        struct task *task = pop_task(ctx->thread, &point);
+        if (task != NULL) {
+            run_task(ctx->thread, task);
+        } else {
+            // the thieves do not keep the clock: the hard limit must not wait for them
+            if (ctx->thread->id == 0)
+                check_clock();
+            sched_yield();
+        }
     }
 
-    int score_max = INT_MIN;
-    struct square from, to;
-    struct game further_game = *game;
-    for (from.file = 0; from.file < 8; from.file++)
-    for (from.rank = 0; from.rank < 8; from.rank++)
-    for (to.file = 0; to.file < 8; to.file++)
-    for (to.rank = 0; to.rank < 8; to.rank++)
-    for (int n_promotion = 0; n_promotion < 5; n_promotion++) {
+    int cutoff = atomic_load(&point.cutoff);
+    for (int i = 0; i < point.task_count; i++) {
+        const struct task *task = &point.tasks[i];
+        if (parallel_mode == PARALLEL_DETERMINISTIC && i > cutoff)
+            break;
+        if (task->state != TASK_DONE)
+            continue;
+        ctx->nodes += task->nodes;
+        ctx->leaves += task->leaves;
+        for (int j = 0; j < task->record_count; j++) {
+            const struct table_record *r = &task->records[j];
+            store_key(ctx, r->key, r->move, r->score, r->depth, r->bound);
+        }
+        bool quiet = !is_capture(game, task->move);
+        if (task->score > *score_max) {
+            *score_max = task->score;
+            *best = task->move;
+            if (task->score > *alpha) {
+                *alpha = task->score;
+                if (point.lines != NULL) {
+                    for (int j = ply + 1; j < task->line_length; j++)
+                        ctx->pv.moves[ply + 1][j] = point.lines[i][j];
+                    ctx->pv.length[ply + 1] = task->line_length;
+                    update_pv(ctx, ply, task->move);
+                }
+            }
+            if (*alpha >= beta) {
+                if (quiet && !halted(ctx))
+                    update_heuristics(&ctx->heuristics, game, ply, depth, task->move, quiets,
+                                      *n_quiets);
+                break;
+            }
+        }
+        if (quiet)
+            quiets[(*n_quiets)++] = task->move;
+    }
+    for (int i = 0; i < point.task_count; i++)
+        free(point.tasks[i].records);
+    free(point.lines);
+}
+
+/*
+ * Alpha-beta search of a position 'ply' half-moves below the root, fail-soft:
+ * returns the score for the side to move if it is within (alpha, beta),
+ * otherwise a bound beyond the window. The game result is found out lazily:
+ * draws by the rules first, checkmate and stalemate only when no moves
+ * were handed out. A position repeated within the search tree is a draw.
+ */
+int search(struct search_context *ctx, int depth, int ply, int alpha, int beta)
+{
+    struct game *game = &ctx->game;
+    ctx->pv.length[ply] = ply;
+    if (depth == 0)
+        return quiesce(ctx, ply, alpha, beta);
+    count_node(ctx);
+    if (halted(ctx))
+        return 0;
+    if (is_repetition(game, ply) || !enough_material(game))
+        return 0;
+
+    /*
+     * A result of a deep enough search of the position may settle it;
+     * except in the principal variation, which would be cut short.
+     */
+    bool pv_node = beta - alpha > 1;
+    encoded_move excluded = ctx->excluded_moves[ply];
+    struct tt_data entry = { NO_MOVE };
+    bool tt_hit = excluded == NO_MOVE && probe(ctx, &entry);
+    if (tt_hit && entry.depth >= depth && !pv_node) {
+        int score = score_from_tt(entry.score, ply);
+        if (entry.bound == BOUND_EXACT ||
+                (entry.bound == BOUND_LOWER && score >= beta) ||
+                (entry.bound == BOUND_UPPER && score <= alpha))
+            return score;
+    }
+
+    if (game->halfmove_clock >= 100)
+        return game->checkers && !has_legal_move(game) ? -value_king + ply : 0;
+
+    int eval = game->checkers ? -value_infinite : static_eval(game);
+
+    /*
+     * Razoring: near the leaves, a position far below alpha will hardly
+     * get above it by a quiet move, the quiescence search decides.
+     */
+    if (!pv_node && !game->checkers && excluded == NO_MOVE && depth <= RAZORING_DEPTH &&
+            eval + razoring_margins[depth] <= alpha) {
+        int score = quiesce(ctx, ply, alpha, alpha + 1);
+        if (score <= alpha || halted(ctx))
+            return score;
+    }
+
+    /*
+     * Reverse futility pruning: near the leaves, a position so far above
+     * beta that no move of the opponent may bring it back is cut at once.
+     */
+    if (!pv_node && !game->checkers && excluded == NO_MOVE && depth <= REVERSE_FUTILITY_DEPTH &&
+            !is_mate_score(beta) && eval - reverse_futility_margins[depth] >= beta)
+        return eval;
+
+    /*
+     * Null move pruning: if the opponent, given two moves in a row, still
+     * cannot get below beta, one of own moves will surely fail high too.
+     * Not in check, not twice in a row, and not without pieces, where
+     * having to move may be a disadvantage (zugzwang). The deeper and
+     * the further above beta, the more the null move search is reduced.
+     */
+    if (!game->checkers && depth >= null_move_min_depth && ply >= ctx->null_move_min_ply &&
+            ply > 0 && ctx->heuristics.played[ply - 1] != NO_MOVE && !is_mate_score(beta) &&
+            excluded == NO_MOVE && has_pieces(game) && eval >= beta) {
+        int reduction = 3 + depth / 4 + min((eval - beta) / value_pawn, 3);
+        int null_depth = max(depth - 1 - reduction, 0);
+        struct undo undo;
+        ctx->heuristics.played[ply] = NO_MOVE;
+        make_null_move(game, &undo);
+        int score = -search(ctx, null_depth, ply + 1, -beta, -beta + 1);
+        unmake_null_move(game, &undo);
+        if (halted(ctx))
+            return 0;
+        if (score >= beta) {
+            if (is_mate_score(score))
+                score = beta; // a mate after passing proves nothing
+            if (depth < null_move_verification_depth || ctx->null_move_min_ply > 0)
+                return score;
+            // deep in the tree, verify by a reduced search without null moves
+            ctx->null_move_min_ply = ply + 3 * null_depth / 4 + 1;
+            int verified = search(ctx, null_depth, ply, beta - 1, beta);
+            ctx->null_move_min_ply = 0;
+            if (verified >= beta)
+                return score;
+        }
+    }
+
+    /*
+     * ProbCut: deep in the tree, a good capture that beats beta by a margin
+     * in a much shallower search will very probably beat beta in the full
+     * depth search too. The quiescence search screens the captures first.
+     */
+    int probcut_beta = beta + probcut_margin;
+    if (!pv_node && !game->checkers && excluded == NO_MOVE && depth >= probcut_min_depth &&
+            !is_mate_score(beta) && !(tt_hit && entry.depth >= depth - 3 &&
+                                      score_from_tt(entry.score, ply) < probcut_beta)) {
+        struct move_picker picker;
+        init_picker(&picker, game, &ctx->heuristics, entry.move, ply, LEGAL|CAPTURES);
+        encoded_move m;
+        while ((m = next_move(&picker)) != NO_MOVE) {
+            if (!see(game, m, probcut_beta - eval))
+                continue;
+            struct undo undo;
+            ctx->heuristics.played[ply] = m;
+            make_move(game, m, &undo);
+            int score = -quiesce(ctx, ply + 1, -probcut_beta, -probcut_beta + 1);
+            if (score >= probcut_beta)
+                score = -search(ctx, depth - probcut_reduction, ply + 1,
+                                -probcut_beta, -probcut_beta + 1);
+            unmake_move(game, m, &undo);
+            if (halted(ctx))
+                return 0;
+            if (score >= probcut_beta) {
+                store(ctx, m, score_to_tt(score, ply), depth - 3, BOUND_LOWER);
+                return score;
+            }
+        }
+    }
+
+    // the table entry may be lost, the previous principal variation helps then
+    encoded_move hint = entry.move != NO_MOVE ? entry.move : pv_move(ctx, ply);
+    struct move_picker picker;
+    init_picker(&picker, game, &ctx->heuristics, hint, ply, LEGAL);
+
+    int alpha_original = alpha;
+    int score_max = -value_infinite;
+    encoded_move best = NO_MOVE;
+    encoded_move quiets[MAX_MOVES]; // quiet moves searched without a cutoff
+    int n_quiets = 0;
+    int move_count = 0;
+    int color = color_index(game->side_to_move);
+    // futility pruning: near the leaves, quiet moves cannot raise eval to alpha
+    bool futile = !pv_node && !game->checkers && depth <= FUTILITY_DEPTH &&
+            !is_mate_score(alpha) && eval + futility_margins[depth] <= alpha;
+    encoded_move m;
+    while ((m = next_move(&picker)) != NO_MOVE) {
+        if (m == excluded)
+            continue;
+        bool quiet = !is_capture(game, m);
+        int history = ctx->heuristics.history[color][move_from(m)][move_to(m)];
+        move_count++;
+
+        /*
+         * Late move pruning: near the leaves, once a move has kept the side
+         * from being mated, the quiet moves after the first few ones, and
+         * the ones with a bad history, are not worth searching.
+         */
+        if (quiet && !game->checkers && depth <= late_move_max_depth &&
+                score_max > -value_king + MAX_PLY) {
+            if (n_quiets >= late_move_count(depth)) {
+                picker.skip_quiets = true;
+                continue;
+            }
+            if (history < -history_per_ply * depth)
+                continue;
+        }
+
+        /*
+         * Singular extension: the table move is extended if a reduced
+         * search shows all the other moves well below its score. If even
+         * they beat beta, several moves do and the node is cut (multi-cut).
+         */
+        int extension = 0;
+        bool extensible = ply < 2 * ctx->root_depth;
+        if (extensible && m == entry.move && ply > 0 && depth >= singular_min_depth &&
+                excluded == NO_MOVE && entry.depth >= depth - 3 && (entry.bound & BOUND_LOWER) &&
+                !is_mate_score(entry.score)) {
+            int singular_beta = score_from_tt(entry.score, ply) - singular_margin * depth;
+            ctx->excluded_moves[ply] = m;
+            int score = search(ctx, (depth - 1) / 2, ply, singular_beta - 1, singular_beta);
+            ctx->excluded_moves[ply] = NO_MOVE;
+            if (halted(ctx))
+                return 0;
+            if (score < singular_beta)
+                extension = 1;
+            else if (singular_beta >= beta)
+                return singular_beta;
+        }
+
         int score;
-        enum move_result move_result = move(&further_game, from, to, promotions[n_promotion]);
-        if (move_result == ILLEGAL)
+        if (!search_move(ctx, m, depth, ply, alpha, beta, extension, move_count, history,
+                         futile, &score)) {
+            score_max = max(score_max, eval + futility_margins[depth]);
             continue;
-        else if (move_result == DRAW)
-            score = 0; 
-        else if (move_result == CHECKMATE)
-            score =  value_king;
-        else
-            score = best_move(&further_game, depth - 1, NULL, NULL, NULL);
+        }
+        if (score > score_max) {
+            score_max = score;
+            best = m;
+            if (score > alpha) {
+                alpha = score;
+                update_pv(ctx, ply, m);
+            }
+            if (alpha >= beta) {
+                // the opponent will not allow this position
+                if (quiet && !halted(ctx))
+                    update_heuristics(&ctx->heuristics, game, ply, depth, m, quiets, n_quiets);
+                break;
+            }
+        }
+        if (quiet)
+            quiets[n_quiets++] = m;
+        if (move_count == 1 && can_split(ctx, depth) && !halted(ctx)) {
+            split(ctx, &picker, depth, ply, &alpha, beta, &score_max, &best, quiets, &n_quiets);
+            break;
+        }
+    }
+    if (halted(ctx))
+        return 0; // the result is incomplete, do not store it
+    if (best == NO_MOVE && excluded != NO_MOVE)
+        return alpha; // only the excluded move
+    if (best == NO_MOVE)
+        return game->checkers ? -value_king + ply : 0; // the sooner mate, the better
+    if (excluded != NO_MOVE)
+        return score_max; // not a result of the full position
+
+    enum tt_bound bound = score_max >= beta ? BOUND_LOWER :
+            score_max > alpha_original ? BOUND_EXACT : BOUND_UPPER;
+    store(ctx, bound == BOUND_UPPER ? NO_MOVE : best,
+             score_to_tt(score_max, ply), depth, bound);
+    return score_max;
+}
+
+/*
+ * Search the root position to the given depth within the window, by principal
+ * variation search. Returns its fail-soft score and the best move; NO_MOVE if
+ * there are no moves or the search was stopped before the first move was
+ * searched. The best move is not known when the score falls below the window.
+ */
+int search_root(struct search_context *ctx, int depth, int alpha, int beta, encoded_move *best)
+{
+    struct game *game = &ctx->game;
+    *best = NO_MOVE;
+    ctx->pv.length[0] = 0;
+    ctx->root_depth = depth;
+    if (depth == 0)
+        return search(ctx, 0, 0, alpha, beta);
+
+    int alpha_original = alpha;
+    int score_max = -value_infinite;
+    struct tt_data entry = { NO_MOVE };
+    probe(ctx, &entry);
+    struct move_picker picker;
+    init_picker(&picker, game, &ctx->heuristics, entry.move != NO_MOVE ? entry.move : pv_move(ctx, 0),
+                0, LEGAL);
+    int move_count = 0;
+    encoded_move m;
+    while ((m = next_move(&picker)) != NO_MOVE) {
+        struct undo undo;
+        ctx->heuristics.played[0] = m;
+        make_move(game, m, &undo);
+        tt_prefetch(game->hash);
+        int score;
+        if (++move_count == 1) {
+            score = -search(ctx, depth - 1, 1, -beta, -alpha);
+        } else {
+            score = -search(ctx, depth - 1, 1, -alpha - 1, -alpha);
+            if (score > alpha && score < beta)
+                score = -search(ctx, depth - 1, 1, -beta, -alpha);
+        }
+        unmake_move(game, m, &undo);
+        if (halted(ctx))
+            break;
         if (score > score_max) {
             score_max = score;
-            // return the best move only in the root call
-            if (best_from != NULL) {
-                *best_from = from;
-                *best_to = to;
-                *best_promotion = promotions[n_promotion];
+            *best = m;
+            if (score > alpha) {
+                alpha = score;
+                update_pv(ctx, 0, m);
             }
+            if (alpha >= beta)
+                break;
         }
-        further_game = *game;
-        if (n_promotion == 0)
-            break; // no need to check any promotions
     }
-    if (best_from != NULL)
-        log_notice("Move %c%d%c%d %d scores %d", best_from->file + 'a', best_from->rank + 1,
-                best_to->file + 'a', best_to->rank + 1, *best_promotion, score_max);
+    if (*best != NO_MOVE && !halted(ctx)) {
+        enum tt_bound bound = score_max >= beta ? BOUND_LOWER :
+                score_max > alpha_original ? BOUND_EXACT : BOUND_UPPER;
+        store(ctx, bound == BOUND_UPPER ? NO_MOVE : *best,
+                 score_to_tt(score_max, 0), depth, bound);
+    }
     return score_max;
 }
+
+void log_best_move(const struct search_context *ctx)
+{
+    char line[6 * 16 + 1] = "";
+    for (int i = 0; i < ctx->pv_line_length && i < 16; i++) {
+        struct square from = index_square(move_from(ctx->pv_line[i]));
+        struct square to = index_square(move_to(ctx->pv_line[i]));
+        sprintf(line + strlen(line), " %c%d%c%d", from.file + 'a', from.rank + 1,
+                to.file + 'a', to.rank + 1);
+    }
+    log_notice("Depth %d: score %d, %lld nodes, hashfull %d, pv%s", ctx->completed_depth,
+            ctx->score, searched_nodes(ctx), tt_hashfull(), line);
+}
+
+// Keep the result of a completed iteration
+void complete_iteration(struct search_context *ctx, int depth, int score, encoded_move best)
+{
+    ctx->completed_depth = depth;
+    ctx->score = score;
+    ctx->best = best;
+    ctx->pv_line_length = ctx->pv.length[0];
+    for (int i = 0; i < ctx->pv_line_length; i++)
+        ctx->pv_line[i] = ctx->pv.moves[0][i];
+}
+
+void set_best_move(encoded_move best,
+        struct square *best_from, struct square *best_to, enum piece *best_promotion)
+{
+    *best_from = index_square(move_from(best));
+    *best_to = index_square(move_to(best));
+    *best_promotion = move_promotion(best);
+}
+
+void free_threads()
+{
+    for (int i = 0; i < search_threads; i++) {
+        for (int j = 0; j < MAX_NESTING; j++) {
+            if (threads[i].contexts[j] != NULL) {
+                free(threads[i].contexts[j]->table.buckets);
+                free(threads[i].contexts[j]->records);
+            }
+            free(threads[i].contexts[j]);
+        }
+        pthread_mutex_destroy(&threads[i].lock);
+    }
+    free(threads);
+}
+
+/*
+ * Search with the given number of threads from now on. Returns false and
+ * keeps the old number if out of memory.
+ */
+bool set_threads(int count)
+{
+    struct search_thread *new_threads = calloc(count, sizeof *new_threads);
+    bool allocated = new_threads != NULL;
+    for (int i = 0; allocated && i < count; i++)
+        allocated = (new_threads[i].contexts[0] = calloc(1, sizeof(struct search_context))) != NULL;
+    if (!allocated) {
+        log_err("No memory for %d search threads", count);
+        for (int i = 0; new_threads != NULL && i < count; i++)
+            free(new_threads[i].contexts[0]);
+        free(new_threads);
+        return false;
+    }
+    for (int i = 0; i < count; i++) {
+        new_threads[i].id = i;
+        pthread_mutex_init(&new_threads[i].lock, NULL);
+        new_threads[i].contexts[0]->thread = &new_threads[i];
+    }
+    if (threads != NULL)
+        free_threads();
+    threads = new_threads;
+    search_threads = count;
+    return true;
+}
+
+// Give the thread its own copy of the position to search
+void start_context(struct search_context *ctx, const struct game *game)
+{
+    ctx->game = *game;
+    if (game->history != NULL) {
+        ctx->history = *game->history;
+        ctx->game.history = &ctx->history;
+    }
+    ctx->nodes = 0;
+    ctx->leaves = 0;
+    ctx->null_move_min_ply = 0;
+    ctx->completed_depth = 0;
+    ctx->score = 0;
+    ctx->best = NO_MOVE;
+    ctx->pv_line_length = 0;
+    clear_heuristics(&ctx->heuristics);
+}
+
+void start_search(const struct game *game)
+{
+    stopped = false;
+    search_start = now();
+    tt_new_search();
+    for (int i = 0; i < search_threads; i++) {
+        atomic_store_explicit(&threads[i].nodes, 0, memory_order_relaxed);
+        start_context(threads[i].contexts[0], game);
+    }
+}
+
+/*
+ * Split the clock into a soft budget, after which no new iteration is
+ * started, and a hard one, at which the search is stopped.
+ */
+void allocate_time(const struct search_limits *limits)
+{
+    clock_limits = (struct clock_limits){ .node_limit = limits->nodes };
+    if (limits->move_time > 0) {
+        clock_limits.soft = clock_limits.hard = max(limits->move_time - move_overhead, 1);
+    } else if (limits->time > 0) {
+        int available = max(limits->time - move_overhead, 1);
+        int moves_to_go = limits->moves_to_go > 0 ? limits->moves_to_go : default_moves_to_go;
+        // at least a millisecond each: zero would mean no limit; half the clock left
+        // at most, so that a stalled iteration does not lose on time
+        clock_limits.soft = max(available / moves_to_go + limits->increment * 3 / 4, 1);
+        clock_limits.hard = max(min(available / 2, clock_limits.soft * 5), 1);
+        clock_limits.soft = min(clock_limits.soft, clock_limits.hard);
+    }
+}
+
+/*
+ * Depth staggering: each helper thread skips some of the depths, by its own
+ * pattern, so that the threads spread over different iterations instead of
+ * searching the same tree in step.
+ */
+const int skip_size[20]  = { 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 3, 3, 4, 4, 4, 4, 4, 4, 4, 4 };
+const int skip_phase[20] = { 0, 1, 0, 1, 2, 3, 0, 1, 2, 3, 4, 5, 0, 1, 2, 3, 4, 5, 6, 7 };
+
+bool skips_depth(const struct search_context *ctx, int depth)
+{
+    int id = ctx->thread->id;
+    if (id == 0)
+        return false;
+    int i = (id - 1) % 20;
+    return (depth + skip_phase[i]) / skip_size[i] % 2 != 0;
+}
+
+/*
+ * Iterative deepening: search the root one ply deeper at a time, until
+ * the depth limit or the time budget is reached. Each iteration searches
+ * the previous principal variation first, within an aspiration window
+ * around the previous score, widened on failure. A stopped iteration is
+ * discarded. Only the main thread reports and keeps the soft time budget.
+ */
+void iterate(struct search_context *ctx)
+{
+    for (int depth = 1; depth <= search_max_depth; depth++) {
+        if (skips_depth(ctx, depth))
+            continue;
+        int delta = aspiration_window;
+        int alpha = -value_infinite, beta = value_infinite;
+        if (depth >= aspiration_min_depth && ctx->completed_depth > 0 &&
+                !is_mate_score(ctx->score)) {
+            alpha = ctx->score - delta;
+            beta = ctx->score + delta;
+        }
+        encoded_move best;
+        int score;
+        while (true) {
+            score = search_root(ctx, depth, alpha, beta, &best);
+            if (stopped || best == NO_MOVE)
+                break;
+            if (score <= alpha)
+                alpha = max(score - delta, -value_infinite);
+            else if (score >= beta)
+                beta = min(score + delta, value_infinite);
+            else
+                break;
+            delta *= 2;
+        }
+        if (stopped || best == NO_MOVE)
+            break;
+        complete_iteration(ctx, depth, score, best);
+        if (ctx->thread->id != 0)
+            continue;
+        log_best_move(ctx);
+        if (report_iteration != NULL)
+            report_iteration(depth, score, searched_nodes(ctx), elapsed(), ctx->pv_line,
+                             ctx->pv_line_length);
+        if (clock_limits.soft > 0 && elapsed() >= clock_limits.soft)
+            break; // the next iteration would not end in time
+    }
+}
+
+// Lazy SMP helper: iterative deepening of its own
+void* helper_thread(void *thread)
+{
+    iterate(((struct search_thread*)thread)->contexts[0]);
+    return NULL;
+}
+
+// Split point helper: steals the tasks of the others until the search is done
+void* worker_thread(void *arg)
+{
+    struct search_thread *thread = arg;
+    atomic_fetch_add(&idle_threads, 1);
+    while (!stopped) {
+        struct task *task = steal_task(thread);
+        if (task == NULL) {
+            sched_yield();
+            continue;
+        }
+        atomic_fetch_sub(&idle_threads, 1);
+        run_task(thread, task);
+        atomic_fetch_add(&idle_threads, 1);
+    }
+    atomic_fetch_sub(&idle_threads, 1);
+    return NULL;
+}
+
+/*
+ * The threads vote for the best moves of their last completed iterations,
+ * a vote weighing the more, the deeper the iteration and the better its
+ * score than the worst one. Returns the deepest thread of the winning move.
+ * Only the main thread has a result when the threads share split points.
+ */
+struct search_context* vote()
+{
+    int score_min = value_infinite;
+    for (int i = 0; i < search_threads; i++)
+        if (threads[i].contexts[0]->best != NO_MOVE)
+            score_min = min(score_min, threads[i].contexts[0]->score);
+
+    struct search_context *winner = threads[0].contexts[0];
+    long long winner_votes = -1;
+    for (int i = 0; i < search_threads; i++) {
+        struct search_context *ctx = threads[i].contexts[0];
+        if (ctx->best == NO_MOVE)
+            continue;
+        long long votes = 0;
+        for (int j = 0; j < search_threads; j++) {
+            const struct search_context *voter = threads[j].contexts[0];
+            if (voter->best == ctx->best)
+                votes += (long long)(voter->score - score_min + value_pawn / 10) *
+                        voter->completed_depth;
+        }
+        if (votes > winner_votes || (votes == winner_votes &&
+                                     ctx->completed_depth > winner->completed_depth)) {
+            winner = ctx;
+            winner_votes = votes;
+        }
+    }
+    return winner;
+}
+
+/*
+ * Search the position with all the threads, the main one in the caller.
+ * Lazy SMP: all the threads search the same root, sharing nothing but
+ * the transposition table, where each finds what the others have
+ * searched. Work stealing: only the main thread searches the root, the
+ * others take over the tasks of its split points, and of their own.
+ * The main thread stops the others when it is done.
+ */
+int think(struct game *game, const struct search_limits *limits,
+        struct square *best_from, struct square *best_to, enum piece *best_promotion)
+{
+    start_search(game);
+    allocate_time(limits);
+
+    bool limited = limits->move_time > 0 || limits->time > 0 || limits->nodes > 0;
+    search_max_depth = limits->depth > 0 ? min(limits->depth, max_depth_limit) :
+            limited ? max_depth_limit : default_depth;
+
+    bool running[MAX_THREADS] = { false };
+    for (int i = 1; i < search_threads; i++) {
+        running[i] = pthread_create(&threads[i].thread, NULL,
+                                    parallel_mode == PARALLEL_LAZY_SMP ? helper_thread : worker_thread,
+                                    &threads[i]) == 0;
+        if (!running[i])
+            log_err("Cannot start search thread %d", i);
+    }
+    iterate(threads[0].contexts[0]);
+    stopped = true;
+    perft = 0;
+    for (int i = 0; i < search_threads; i++) {
+        if (running[i])
+            pthread_join(threads[i].thread, NULL);
+        perft += threads[i].contexts[0]->leaves;
+    }
+
+    struct search_context *winner = vote();
+    encoded_move best = winner->best;
+    if (best == NO_MOVE) {
+        // not even depth 1 was completed: play any legal move
+        struct move_list list;
+        generate_moves(game, &list, LEGAL);
+        if (list.count == 0)
+            return winner->score;
+        best = list.moves[0];
+    }
+    if (winner->thread->id != 0) {
+        log_notice("Thread %d wins the vote: depth %d, score %d", winner->thread->id,
+                winner->completed_depth, winner->score);
+        // the last line reported was the main thread's, the move played is the winner's
+        if (report_iteration != NULL)
+            report_iteration(winner->completed_depth, winner->score,
+                             searched_nodes(threads[0].contexts[0]), elapsed(),
+                             winner->pv_line, winner->pv_line_length);
+    }
+    set_best_move(best, best_from, best_to, best_promotion);
+    return winner->score;
+}
@@ -3,9 +3,49 @@
 
 #include "game.h"
 
+// What the go command allows the search, in milliseconds; 0 for no limit
+struct search_limits {
+    int time; // left on the clock of the side to move
+    int increment;
+    int moves_to_go; // to the next time control
+    int move_time; // exactly this long
+    int depth;
+    long long nodes;
+};
+
+#define MAX_PLY 256 // deeper than any search
+
+// Deepest remaining depth each shallow pruning applies to
+#define REVERSE_FUTILITY_DEPTH 6
+#define FUTILITY_DEPTH 3
+#define RAZORING_DEPTH 2
+
+extern const int value_pawn;
+extern const int value_king;
+#define MAX_THREADS 256
+
+enum parallel_mode {
+    PARALLEL_LAZY_SMP, // threads search the same tree, sharing the transposition table
+    PARALLEL_WORK_STEALING, // threads steal the moves of split points from each other
+    PARALLEL_DETERMINISTIC, // the same, with the same tree and result in every run
+};
+
 extern int perft;
+extern int move_overhead;
+extern int search_threads;
+extern enum parallel_mode parallel_mode;
+extern int reverse_futility_margins[REVERSE_FUTILITY_DEPTH + 1];
+extern int futility_margins[FUTILITY_DEPTH + 1];
+extern int razoring_margins[RAZORING_DEPTH + 1];
+
+// Called after each completed iteration of think(); the time is in milliseconds
+extern void (*report_iteration)(int depth, int score, long long nodes, long long time,
+                                const encoded_move *pv, int pv_length);
 
-int best_move(struct game *game, int depth,
-        struct square *best_from, struct square *best_to, enum piece *best_promotion); 
+long long now();
+void ai_init();
+bool set_threads(int count);
+int think(struct game *game, const struct search_limits *limits,
+        struct square *best_from, struct square *best_to, enum piece *best_promotion);
 
 #endif // AI_H
@@ -0,0 +1,174 @@
+#include "bitboard.h"
+
+bitboard knight_attacks[64];
+bitboard king_attacks[64];
+bitboard pawn_attacks[2][64];
+
+struct magic bishop_magics[64];
+struct magic rook_magics[64];
+
+bitboard between[64][64];
+bitboard line[64][64];
+
+// Attack sets for all squares and blocker subsets, shared by the magics
+bitboard bishop_table[5248];
+bitboard rook_table[102400];
+
+const int bishop_directions[4][2] = { { 1, 1 }, { 1, -1 }, { -1, -1 }, { -1, 1 } };
+const int rook_directions[4][2] = { { 0, 1 }, { 1, 0 }, { 0, -1 }, { -1, 0 } };
+
+// Set of the squares reached from 'square' by the given file and rank steps
+bitboard leaper_attacks(int square, const int steps[][2], int n_steps)
+{
+    bitboard result = 0;
+    int file = square % 8;
+    int rank = square / 8;
+    for (int i = 0; i < n_steps; i++) {
+        int to_file = file + steps[i][0];
+        int to_rank = rank + steps[i][1];
+        if (to_file >= 0 && to_file <= 7 && to_rank >= 0 && to_rank <= 7)
+            result |= square_bit(to_rank * 8 + to_file);
+    }
+    return result;
+}
+
+// Attacks of a slider found by walking the rays; used only to fill the tables
+bitboard slider_attacks(int square, bitboard occupancy, const int directions[4][2])
+{
+    bitboard result = 0;
+    for (int i = 0; i < 4; i++) {
+        int file = square % 8 + directions[i][0];
+        int rank = square / 8 + directions[i][1];
+        while (file >= 0 && file <= 7 && rank >= 0 && rank <= 7) {
+            bitboard bit = square_bit(rank * 8 + file);
+            result |= bit;
+            if (occupancy & bit)
+                break;
+            file += directions[i][0];
+            rank += directions[i][1];
+        }
+    }
+    return result;
+}
+
+// xorshift64* generator; callers seed it with a constant for reproducible keys
+uint64_t random64(uint64_t *state)
+{
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 0x2545F4914F6CDD1DULL;
+}
+
+/*
+ * Magic numbers found once by trial and error: sparse random numbers
+ * that map every blocker subset of a square's mask to an index
+ * without a harmful collision.
+ */
+static const bitboard bishop_magic_numbers[64] = {
+    0x10102002004A1420ULL, 0x8020040400584008ULL, 0x10510800811201C8ULL, 0x5204042080000088ULL,
+    0x2204106880000002ULL, 0x1401042004000000ULL, 0x0400880410042004ULL, 0x0028208200A02020ULL,
+    0x1500241990010E00ULL, 0x8001200182020A40ULL, 0x40004101030B0000ULL, 0x8002041042000100ULL,
+    0x4010011041020038ULL, 0x0000010421044000ULL, 0x1500210808020A00ULL, 0x8000088400880520ULL,
+    0x0405004010040100ULL, 0x1005823210040108ULL, 0x2708008102040011ULL, 0x4048200404009100ULL,
+    0x0018104101400024ULL, 0x0003000601190101ULL, 0x8004803108491000ULL, 0x8014241200820800ULL,
+    0x0006E080100C3040ULL, 0x0501044A11041800ULL, 0x9020300008004045ULL, 0x0894080000220040ULL,
+    0x1001010083104000ULL, 0x5004030040900080ULL, 0x000400422C012400ULL, 0x0002128698404812ULL,
+    0x1010108404900440ULL, 0x0928021182084100ULL, 0x2006080409020024ULL, 0x1010202020180080ULL,
+    0xA010008200202200ULL, 0x2098015100019004ULL, 0x0002041440810811ULL, 0x802A02020000B098ULL,
+    0x0009015090004060ULL, 0x4000821082081001ULL, 0x0100210040420800ULL, 0x0800004010488A00ULL,
+    0x2000081104004040ULL, 0x4C8E029015000082ULL, 0x0420340322224842ULL, 0x1298260043400210ULL,
+    0x0000822802400008ULL, 0x00008A0101600000ULL, 0x3040003412080021ULL, 0x3040290220884800ULL,
+    0x4A1500401041004AULL, 0x8010200282020781ULL, 0x0020203142209091ULL, 0x0070300600902110ULL,
+    0x0040808800B62048ULL, 0x0000810400C44420ULL, 0x00080400440C0441ULL, 0x8340080020840411ULL,
+    0x0000000104208200ULL, 0x0000800810D00080ULL, 0x0400530411080200ULL, 0x4040702400932244ULL,
+};
+
+static const bitboard rook_magic_numbers[64] = {
+    0x1080004008801020ULL, 0x0840092002C03000ULL, 0x1900200010400900ULL, 0x0880100008000480ULL,
+    0x4200100420080200ULL, 0x8100020100080400ULL, 0x0200040110886200ULL, 0x0200008040220411ULL,
+    0x0404800084400220ULL, 0x0000401000402000ULL, 0x0086001081220440ULL, 0x0408800800100280ULL,
+    0x000A001201040820ULL, 0x8848800200840080ULL, 0x4001000100040200ULL, 0x0442000102105084ULL,
+    0x9080010020804100ULL, 0x0040404000201009ULL, 0x0000808010002009ULL, 0x2200090021D00100ULL,
+    0x0008008008040080ULL, 0x0004004002010040ULL, 0x0011040008015042ULL, 0x00000A0001768104ULL,
+    0x0000800080204009ULL, 0x2010004140002001ULL, 0x9800200280100080ULL, 0x1000100080080080ULL,
+    0x0442000A00049020ULL, 0x2100040080020080ULL, 0x0800120400900148ULL, 0x0010040A00128541ULL,
+    0x2800804000800030ULL, 0x1010002000400041ULL, 0x4000200011004100ULL, 0x0610008410800800ULL,
+    0x0400802402800800ULL, 0xC100020080800400ULL, 0x0002000802000401ULL, 0x0182085882000401ULL,
+    0x0220204000808000ULL, 0x2860100040024022ULL, 0x0001002004110040ULL, 0x99101042000A0020ULL,
+    0x0004080004008080ULL, 0x0010040002008080ULL, 0x2012004881020004ULL, 0x8300842444820011ULL,
+    0x0088403882010200ULL, 0x0820400080210100ULL, 0x0110910040A00300ULL, 0x0801100280080480ULL,
+    0x0242009008200600ULL, 0x1002000489500200ULL, 0x0040800200010080ULL, 0x0091800041000080ULL,
+    0x0000209300488001ULL, 0x04C1002414824001ULL, 0x020020000B001041ULL, 0x7000100004200901ULL,
+    0x8002002004100802ULL, 0x30010002084C0007ULL, 0x0888221800813004ULL, 0x4000002840840112ULL,
+};
+
+/*
+ * Fill the attack table of every square with the given magic numbers.
+ * 'table' must fit all the squares' subsets.
+ */
+void init_magics(struct magic magics[64], bitboard *table, const int directions[4][2],
+                 const bitboard magic_numbers[64])
+{
+    for (int square = 0; square < 64; square++) {
+        struct magic *m = &magics[square];
+        // a blocker on the board edge does not change the attacks
+        bitboard edges = ((RANK_1_BB | RANK_8_BB) & ~(RANK_1_BB << (square / 8 * 8))) |
+                ((FILE_A_BB | FILE_H_BB) & ~(FILE_A_BB << (square % 8)));
+        m->mask = slider_attacks(square, 0, directions) & ~edges;
+        m->shift = 64 - popcount(m->mask);
+        m->magic = magic_numbers[square];
+        m->attacks = table;
+
+        // enumerate all the subsets of the mask (Carry-Rippler trick)
+        bitboard subset = 0;
+        do {
+            table[(subset * m->magic) >> m->shift] = slider_attacks(square, subset, directions);
+            subset = (subset - m->mask) & m->mask;
+        } while (subset);
+        table += 1 << popcount(m->mask);
+    }
+}
+
+/*
+ * Precompute the attack tables. Must be called once before any game is played.
+ */
+void bitboard_init()
+{
+    static const int knight_steps[8][2] = {
+        { 1, 2 }, { 2, 1 }, { 2, -1 }, { 1, -2 },
+        { -1, -2 }, { -2, -1 }, { -2, 1 }, { -1, 2 },
+    };
+    static const int king_steps[8][2] = {
+        { 0, 1 }, { 1, 1 }, { 1, 0 }, { 1, -1 },
+        { 0, -1 }, { -1, -1 }, { -1, 0 }, { -1, 1 },
+    };
+    static const int white_pawn_steps[2][2] = { { -1, 1 }, { 1, 1 } };
+    static const int black_pawn_steps[2][2] = { { -1, -1 }, { 1, -1 } };
+
+    for (int square = 0; square < 64; square++) {
+        knight_attacks[square] = leaper_attacks(square, knight_steps, 8);
+        king_attacks[square] = leaper_attacks(square, king_steps, 8);
+        pawn_attacks[0][square] = leaper_attacks(square, white_pawn_steps, 2);
+        pawn_attacks[1][square] = leaper_attacks(square, black_pawn_steps, 2);
+    }
+
+    init_magics(bishop_magics, bishop_table, bishop_directions, bishop_magic_numbers);
+    init_magics(rook_magics, rook_table, rook_directions, rook_magic_numbers);
+
+    for (int a = 0; a < 64; a++)
+    for (int b = 0; b < 64; b++) {
+        between[a][b] = line[a][b] = 0;
+        if (a == b)
+            continue;
+        if (bishop_attacks(a, 0) & square_bit(b)) {
+            between[a][b] = bishop_attacks(a, square_bit(b)) & bishop_attacks(b, square_bit(a));
+            line[a][b] = (bishop_attacks(a, 0) & bishop_attacks(b, 0)) |
+                    square_bit(a) | square_bit(b);
+        } else if (rook_attacks(a, 0) & square_bit(b)) {
+            between[a][b] = rook_attacks(a, square_bit(b)) & rook_attacks(b, square_bit(a));
+            line[a][b] = (rook_attacks(a, 0) & rook_attacks(b, 0)) |
+                    square_bit(a) | square_bit(b);
+        }
+    }
+}
@@ -0,0 +1,84 @@
+#ifndef BITBOARD_H
+#define BITBOARD_H
+
+#include <stdint.h>
+
+/*
+ * A set of squares, one bit per square: a1 = bit 0, b1 = bit 1, ..., h8 = bit 63
+ */
+typedef uint64_t bitboard;
+
+#define FILE_A_BB 0x0101010101010101ULL
+#define FILE_H_BB 0x8080808080808080ULL
+#define RANK_1_BB 0x00000000000000FFULL
+#define RANK_8_BB 0xFF00000000000000ULL
+
+// Attacks of the leaping pieces, filled by bitboard_init()
+extern bitboard knight_attacks[64];
+extern bitboard king_attacks[64];
+extern bitboard pawn_attacks[2][64]; // [white, black][square]
+
+/*
+ * Sliding attacks by magic bitboards: the relevant blockers of a square are
+ * multiplied by a magic number and shifted to an index in the attack table.
+ */
+struct magic {
+    bitboard mask; // relevant occupancy, board edges excluded
+    bitboard magic;
+    bitboard *attacks;
+    int shift;
+};
+
+extern struct magic bishop_magics[64];
+extern struct magic rook_magics[64];
+
+// Squares strictly between two squares on a line, and the whole line through them;
+// empty sets if the squares are not on a common rank, file or diagonal
+extern bitboard between[64][64];
+extern bitboard line[64][64];
+
+void bitboard_init();
+uint64_t random64(uint64_t *state);
+
+static inline bitboard square_bit(int square)
+{
+    return 1ULL << square;
+}
+
+// Index of the least significant set bit; the set must not be empty
+static inline int lsb(bitboard set)
+{
+    return __builtin_ctzll(set);
+}
+
+// Remove the least significant set bit and return its index
+static inline int pop_lsb(bitboard *set)
+{
+    int square = __builtin_ctzll(*set);
+    *set &= *set - 1;
+    return square;
+}
+
+static inline int popcount(bitboard set)
+{
+    return __builtin_popcountll(set);
+}
+
+static inline bitboard bishop_attacks(int square, bitboard occupancy)
+{
+    const struct magic *m = &bishop_magics[square];
+    return m->attacks[((occupancy & m->mask) * m->magic) >> m->shift];
+}
+
+static inline bitboard rook_attacks(int square, bitboard occupancy)
+{
+    const struct magic *m = &rook_magics[square];
+    return m->attacks[((occupancy & m->mask) * m->magic) >> m->shift];
+}
+
+static inline bitboard queen_attacks(int square, bitboard occupancy)
+{
+    return bishop_attacks(square, occupancy) | rook_attacks(square, occupancy);
+}
+
+#endif // BITBOARD_H
@@ -8,8 +8,8 @@
 #include "log.h"
 
 bool is_attacked_by(const struct game *game, struct square square, enum piece color);
-bool is_attacked(const struct game *game, struct square square);
-bool is_checked(const struct game *game, enum piece color);
+void update_attacks(struct game *game, bitboard changed);
+void find_checkers(struct game *game);
 
 const char *move_result_text[] = {
     "default",
@@ -19,18 +19,39 @@ const char *move_result_text[] = {
     "illegal",
 };
 
-// Starting position
-const struct game setup = {
-    .board = {
-        { WHITE|ROOK,   WHITE|PAWN, 0, 0, 0, 0, BLACK|PAWN, BLACK|ROOK   },
-        { WHITE|KNIGHT, WHITE|PAWN, 0, 0, 0, 0, BLACK|PAWN, BLACK|KNIGHT },
-        { WHITE|BISHOP, WHITE|PAWN, 0, 0, 0, 0, BLACK|PAWN, BLACK|BISHOP },
-        { WHITE|QUEEN,  WHITE|PAWN, 0, 0, 0, 0, BLACK|PAWN, BLACK|QUEEN  },
-        { WHITE|KING,   WHITE|PAWN, 0, 0, 0, 0, BLACK|PAWN, BLACK|KING   },
-        { WHITE|BISHOP, WHITE|PAWN, 0, 0, 0, 0, BLACK|PAWN, BLACK|BISHOP },
-        { WHITE|KNIGHT, WHITE|PAWN, 0, 0, 0, 0, BLACK|PAWN, BLACK|KNIGHT },
-        { WHITE|ROOK,   WHITE|PAWN, 0, 0, 0, 0, BLACK|PAWN, BLACK|ROOK   } },
-    
+#define W(piece) (WHITE|piece)
+#define B(piece) (BLACK|piece)
+
+// Starting position; the hash is filled by game_init()
+struct game setup = {
+    .pieces = {
+        0x00FF00000000FF00, // pawns
+        0x4200000000000042, // knights
+        0x2400000000000024, // bishops
+        0x8100000000000081, // rooks
+        0x0800000000000008, // queens
+        0x1000000000000010, // kings
+    },
+    .colors = {
+        0x000000000000FFFF, // white
+        0xFFFF000000000000, // black
+    },
+    .mailbox = {
+        W(ROOK), W(KNIGHT), W(BISHOP), W(QUEEN), W(KING), W(BISHOP), W(KNIGHT), W(ROOK),
+        W(PAWN), W(PAWN),   W(PAWN),   W(PAWN),  W(PAWN), W(PAWN),   W(PAWN),   W(PAWN),
+        0, 0, 0, 0, 0, 0, 0, 0,
+        0, 0, 0, 0, 0, 0, 0, 0,
+        0, 0, 0, 0, 0, 0, 0, 0,
+        0, 0, 0, 0, 0, 0, 0, 0,
+        B(PAWN), B(PAWN),   B(PAWN),   B(PAWN),  B(PAWN), B(PAWN),   B(PAWN),   B(PAWN),
+        B(ROOK), B(KNIGHT), B(BISHOP), B(QUEEN), B(KING), B(BISHOP), B(KNIGHT), B(ROOK),
+    },
+    .piece_count = {
+        { 8, 2, 2, 2, 1, 1 },
+        { 8, 2, 2, 2, 1, 1 },
+    },
+    .king_square = { 4, 60 },
+
     .side_to_move = WHITE,
     .white_castling_avail = KING | QUEEN,
     .black_castling_avail = KING | QUEEN,
@@ -38,6 +59,110 @@ const struct game setup = {
     .halfmove_clock = 0,
 };
 
+#undef W
+#undef B
+
+/*
+ * Zobrist keys, the same in every run
+ */
+uint64_t piece_keys[12][64]; // [color_index * 6 + type_index][square]
+uint64_t castling_keys[16]; // by castling_index()
+uint64_t en_passant_keys[8];
+uint64_t black_to_move_key;
+
+/*
+ * Prepare the lookup tables. Must be called once at the program start.
+ */
+void game_init()
+{
+    bitboard_init();
+
+    uint64_t random_state = 0x2F0B3C4D5E6F7081ULL;
+    for (int piece = 0; piece < 12; piece++)
+        for (int square = 0; square < 64; square++)
+            piece_keys[piece][square] = random64(&random_state);
+    // a key for each right, combined
+    uint64_t castling_right_keys[4];
+    for (int i = 0; i < 4; i++)
+        castling_right_keys[i] = random64(&random_state);
+    for (int rights = 0; rights < 16; rights++) {
+        castling_keys[rights] = 0;
+        for (int i = 0; i < 4; i++)
+            if (rights & (1 << i))
+                castling_keys[rights] ^= castling_right_keys[i];
+    }
+    for (int file = 0; file < 8; file++)
+        en_passant_keys[file] = random64(&random_state);
+    black_to_move_key = random64(&random_state);
+
+    setup.hash = hash(&setup);
+    update_attacks(&setup, ~0ULL);
+    find_checkers(&setup);
+}
+
+static inline uint64_t piece_key(enum piece piece, int square)
+{
+    return piece_keys[color_index(piece) * 6 + type_index(piece)][square];
+}
+
+// Both sides' castling availability packed into 4 bits
+static inline int castling_index(const struct game *game)
+{
+    return (game->white_castling_avail >> 6) | (game->black_castling_avail >> 6) << 2;
+}
+
+/*
+ * Own pawns that may take en passant, and the square they would move to:
+ * they stand where an opponent pawn would attack the target square from.
+ * None, and the target -1, if the last move was no double push.
+ */
+static inline bitboard en_passant_capturers(const struct game *game, int *target)
+{
+    if (game->en_passant_file < 0) {
+        *target = -1;
+        return 0;
+    }
+    int color = color_index(game->side_to_move);
+    *target = (color == 0 ? 5 * 8 : 2 * 8) + game->en_passant_file;
+    return pawn_attacks[color ^ 1][*target] & pieces_of(game, game->side_to_move|PAWN);
+}
+
+// The position is different only if a pawn can really be taken en passant
+uint64_t en_passant_key(const struct game *game)
+{
+    int target;
+    if (en_passant_capturers(game, &target))
+        return en_passant_keys[game->en_passant_file];
+    return 0;
+}
+
+void put_piece(struct game *game, int square, enum piece piece)
+{
+    bitboard bit = square_bit(square);
+    game->hash ^= piece_key(piece, square);
+    game->mailbox[square] = piece;
+    game->pieces[type_index(piece)] |= bit;
+    game->colors[color_index(piece)] |= bit;
+    game->piece_count[color_index(piece)][type_index(piece)]++;
+    if (piece & KING)
+        game->king_square[color_index(piece)] = square;
+}
+
+// Returns the removed piece or EMPTY
+enum piece remove_piece(struct game *game, int square)
+{
+    enum piece piece = game->mailbox[square];
+    if (piece == EMPTY)
+        return EMPTY;
+    bitboard bit = square_bit(square);
+    game->hash ^= piece_key(piece, square);
+    game->mailbox[square] = EMPTY;
+    game->pieces[type_index(piece)] &= ~bit;
+    game->colors[color_index(piece)] &= ~bit;
+    game->piece_count[color_index(piece)][type_index(piece)]--;
+    return piece;
+}
+
 // Convert Forsyth-Edwards notation (FEN) to game
 // Returns *game that must be freed manually
 // Return NULL on incorrect FEN format
@@ -45,6 +170,7 @@ struct game* fen_to_game(char *fen)
 {
     struct game* result = malloc(sizeof(struct game));
     memset(result, 0, sizeof(struct game));
+    result->en_passant_file = -1;
     int file = 0, rank = 7;
     int i = -1;
 
@@ -63,25 +189,31 @@ struct game* fen_to_game(char *fen)
             continue;
         }
 
+        int square = rank * 8 + file;
         switch (fen[i]) {
-        case 'P': result->board[file][rank] = WHITE|PAWN;   break;
-        case 'N': result->board[file][rank] = WHITE|KNIGHT; break;
-        case 'B': result->board[file][rank] = WHITE|BISHOP; break;
-        case 'R': result->board[file][rank] = WHITE|ROOK;   break;
-        case 'Q': result->board[file][rank] = WHITE|QUEEN;  break;
-        case 'K': result->board[file][rank] = WHITE|KING;   break;
-        case 'p': result->board[file][rank] = BLACK|PAWN;   break;
-        case 'n': result->board[file][rank] = BLACK|KNIGHT; break;
-        case 'b': result->board[file][rank] = BLACK|BISHOP; break;
-        case 'r': result->board[file][rank] = BLACK|ROOK;   break;
-        case 'q': result->board[file][rank] = BLACK|QUEEN;  break;
-        case 'k': result->board[file][rank] = BLACK|KING;   break;
+        case 'P': put_piece(result, square, WHITE|PAWN);   break;
+        case 'N': put_piece(result, square, WHITE|KNIGHT); break;
+        case 'B': put_piece(result, square, WHITE|BISHOP); break;
+        case 'R': put_piece(result, square, WHITE|ROOK);   break;
+        case 'Q': put_piece(result, square, WHITE|QUEEN);  break;
+        case 'K': put_piece(result, square, WHITE|KING);   break;
+        case 'p': put_piece(result, square, BLACK|PAWN);   break;
+        case 'n': put_piece(result, square, BLACK|KNIGHT); break;
+        case 'b': put_piece(result, square, BLACK|BISHOP); break;
+        case 'r': put_piece(result, square, BLACK|ROOK);   break;
+        case 'q': put_piece(result, square, BLACK|QUEEN);  break;
+        case 'k': put_piece(result, square, BLACK|KING);   break;
         default: goto ERROR;
         }
 
         file++;
     }
 
+    // both kings are required by the rules code
+    if (result->piece_count[0][type_index(KING)] != 1 ||
+        result->piece_count[1][type_index(KING)] != 1)
+        goto ERROR;
+
     switch (fen[++i]) {
     case 'w': result->side_to_move = WHITE; break;
     case 'b': result->side_to_move = BLACK; break;
@@ -121,6 +253,9 @@ struct game* fen_to_game(char *fen)
     if (result->halfmove_clock < 0 || result->halfmove_clock > 100)
         goto ERROR;
 
+    result->hash = hash(result);
+    update_attacks(result, ~0ULL);
+    find_checkers(result);
     return result; 
 
 ERROR:
@@ -130,280 +265,373 @@ ERROR:
 
 enum piece piece_at(const struct game *game, struct square square)
 {
-    return game->board[square.file][square.rank]; 
+    return game->mailbox[square_index(square)];
 } 
 
 /*
- * Get the game hash, the Zobrist algorithm
- * The hash of a same game may differ across the program runs.
+ * Compute the game hash (the Zobrist algorithm) from scratch.
+ * make_move() keeps game.hash up to date incrementally.
  */
-int hash(const struct game *game)
-{
-    static bool init = false;
-    static int piece_hash[8][8][12]; // random nubers for each square-piece
-    static int en_passant_hash[8];
-    static int castling_avail_hash[4];
-    static int white_to_move_hash;
-    if (!init) {
-        for (int file = 0; file < 8; file++)
-        for (int rank = 0; rank < 8; rank++)
-        for (int piece = 0; piece < 12; piece++)
-            piece_hash[file][rank][piece] = rand();
-        for (int file = 0; file < 8; file++)
-            en_passant_hash[file] = rand();
-        for (int i = 0; i < 4; i++)
-            castling_avail_hash[i] = rand();
-        white_to_move_hash = rand();
-        init = true;
-    }
-
-    int result = 0;
-    struct square square;
-    for (square.file = 0; square.file < 8; square.file++)
-    for (square.rank = 0; square.rank < 8; square.rank++) {
-        switch(piece_at(game, square)) {
-        case WHITE|PAWN:   result ^= piece_hash[square.file][square.rank][0];  break;
-        case WHITE|KNIGHT: result ^= piece_hash[square.file][square.rank][1];  break;
-        case WHITE|BISHOP: result ^= piece_hash[square.file][square.rank][2];  break;
-        case WHITE|ROOK:   result ^= piece_hash[square.file][square.rank][3];  break;
-        case WHITE|QUEEN:  result ^= piece_hash[square.file][square.rank][4];  break;
-        case WHITE|KING:   result ^= piece_hash[square.file][square.rank][5];  break;
-        case BLACK|PAWN:   result ^= piece_hash[square.file][square.rank][6];  break;
-        case BLACK|KNIGHT: result ^= piece_hash[square.file][square.rank][7];  break;
-        case BLACK|BISHOP: result ^= piece_hash[square.file][square.rank][8];  break;
-        case BLACK|ROOK:   result ^= piece_hash[square.file][square.rank][9];  break;
-        case BLACK|QUEEN:  result ^= piece_hash[square.file][square.rank][10]; break;
-        case BLACK|KING:   result ^= piece_hash[square.file][square.rank][11]; break;
-        }
-    } 
-
-    // the position is different if a pawn can no longer be taken en passant
-    if (game->en_passant_file >= 0) {
-        enum piece moving_pawn = game->side_to_move | PAWN;
-        struct square en_passant_pawn;
-        en_passant_pawn.rank = game->side_to_move == WHITE ? 4 : 3;
-        en_passant_pawn.file = game->en_passant_file - 1;
-        if (en_passant_pawn.file >= 1 && piece_at(game, en_passant_pawn) == moving_pawn) {
-            result ^= en_passant_hash[game->en_passant_file];
-        } else {
-            en_passant_pawn.file = game->en_passant_file + 1;
-            if (en_passant_pawn.file <= 6 && piece_at(game, en_passant_pawn) == moving_pawn) {
-                result ^= en_passant_hash[game->en_passant_file];
-            }
-        }
+uint64_t hash(const struct game *game)
+{
+    uint64_t result = 0;
+    bitboard pieces = occupied(game);
+    while (pieces) {
+        int square = pop_lsb(&pieces);
+        result ^= piece_key(game->mailbox[square], square);
     }
 
+    result ^= en_passant_key(game);
     // castling availability is accounted even if the king cannot castle at the moment
-    if (game->white_castling_avail & QUEEN)
-        result ^= castling_avail_hash[0];
-    if (game->white_castling_avail & KING)
-        result ^= castling_avail_hash[1];
-    if (game->black_castling_avail & QUEEN)
-        result ^= castling_avail_hash[2];
-    if (game->black_castling_avail & KING)
-        result ^= castling_avail_hash[3];
-    if (game->side_to_move == WHITE)
-        result ^= white_to_move_hash;
+    result ^= castling_keys[castling_index(game)];
+    if (game->side_to_move == BLACK)
+        result ^= black_to_move_key;
 
     return result;
 }
 
-/*
- * Check the destination correctness and the free way to it.
- * We already know that there is no own piece in the destination.
- */
-bool pawn_has_way(const struct game *game, struct square from, struct square to)
-{
-    assert((piece_at(game, from) & PIECE_TYPE) == PAWN && "checking not pawn");
-    int direction = ((piece_at(game, from) & COLOR) == WHITE) ? 1 : -1;
-    int advance = to.rank - from.rank;
-
-    // Just move, no capture
-    if (from.file == to.file) {
-        if (piece_at(game, to) != EMPTY)
-            return false;
-        if (advance == direction && piece_at(game, to) == EMPTY)
-            return true;
-        if (advance == 2 * direction) {
-            int pawn_start_rank = (game->side_to_move == WHITE) ? 1 : 6;
-            if (from.rank != pawn_start_rank)
-                return false;
-            if (game->board[from.file][pawn_start_rank + direction] != EMPTY)
-                return false;
-            return true;
-        }
-        return false;
-    }
-
-    // Capture
-    if (abs(from.file - to.file) != 1)
-        return false;
-    if (advance != direction)
-        return false;
-    if (piece_at(game, to) != EMPTY)
-        return true;
-    int en_passant_rank = (game->side_to_move == WHITE) ? 5 : 2;
-    if (to.file == game->en_passant_file && to.rank == en_passant_rank)
-        return true;
-    return false;
-}
-
-bool knight_has_way(struct square from, struct square to)
+bool is_attacked_by(const struct game *game, struct square square, enum piece color)
 {
-    int file_move = abs(from.file - to.file);
-    int rank_move = abs(from.rank - to.rank);
-    if ((file_move == 1 && rank_move == 2) || (file_move == 2 && rank_move == 1))
-        return true;
-    return false; 
+    return game->attacked_by[color_index(color)] & square_bit(square_index(square));
 }
 
-bool bishop_has_way(const struct game *game, struct square from, struct square to)
+// Attacked squares of a knight, bishop, rook, queen or king
+bitboard piece_attacks(enum piece type, int square, bitboard occupancy)
 {
-    int file_move = abs(from.file - to.file);
-    int rank_move = abs(from.rank - to.rank);
-    if (file_move != rank_move)
-        return false;
-    int file_direction = (to.file > from.file) ? 1 : -1;
-    int rank_direction = (to.rank > from.rank) ? 1 : -1;
-    int file = from.file;
-    int rank = from.rank;
-    for (int i = 1; i < file_move; i++) {
-        file += file_direction;
-        rank += rank_direction;
-        if (game->board[file][rank] != EMPTY)
-            return false;
+    switch (type & PIECE_TYPE) {
+    case KNIGHT: return knight_attacks[square];
+    case BISHOP: return bishop_attacks(square, occupancy);
+    case ROOK:   return rook_attacks(square, occupancy);
+    case QUEEN:  return queen_attacks(square, occupancy);
+    case KING:   return king_attacks[square];
     }
-    return true;
+    assert(false && "piece_attacks()");
+    return 0;
 }
 
-bool rook_has_way(const struct game *game, struct square from, struct square to)
+/*
+ * Refresh the attack maps after the pieces on the 'changed' squares were moved,
+ * captured or placed. Besides those pieces, only the sliders whose rays
+ * reach the changed squares get their attacks recomputed.
+ */
+void update_attacks(struct game *game, bitboard changed)
 {
-    if (from.file != to.file && from.rank != to.rank)
-        return false;
+    bitboard occupancy = occupied(game);
+    bitboard queens = game->pieces[type_index(QUEEN)];
+    bitboard bishops = game->pieces[type_index(BISHOP)] | queens;
+    bitboard rooks = game->pieces[type_index(ROOK)] | queens;
+
+    bitboard refresh = changed & occupancy;
+    bitboard vacated = changed & ~occupancy;
+    while (vacated)
+        game->attacks_from[pop_lsb(&vacated)] = 0;
+    while (changed) {
+        int square = pop_lsb(&changed);
+        refresh |= (bishop_attacks(square, occupancy) & bishops) |
+                   (rook_attacks(square, occupancy) & rooks);
+    }
 
-    if (from.file == to.file) {
-        int direction = (to.rank > from.rank) ? 1 : -1;
-        for (int rank = from.rank + direction; rank != to.rank; rank += direction)
-            if (game->board[from.file][rank] != EMPTY)
-                return false;
+    while (refresh) {
+        int square = pop_lsb(&refresh);
+        enum piece piece = game->mailbox[square];
+        if (piece & PAWN)
+            game->attacks_from[square] = pawn_attacks[color_index(piece)][square];
+        else
+            game->attacks_from[square] = piece_attacks(piece, square, occupancy);
     }
 
-    if (from.rank == to.rank) {
-        int direction = (to.file > from.file) ? 1 : -1;
-        for (int file = from.file + direction; file != to.file; file += direction)
-            if (game->board[file][from.rank] != EMPTY)
-                return false;
-    } 
+    for (int color = 0; color < 2; color++) {
+        bitboard attacked = 0;
+        bitboard pieces = game->colors[color];
+        while (pieces)
+            attacked |= game->attacks_from[pop_lsb(&pieces)];
+        game->attacked_by[color] = attacked;
+    }
+}
 
-    return true;
+// The squares whose contents the move changes
+bitboard changed_squares(encoded_move m)
+{
+    int from = move_from(m);
+    int to = move_to(m);
+    bitboard result = square_bit(from) | square_bit(to);
+    if (move_type(m) == MOVE_EN_PASSANT)
+        result |= square_bit((from & ~7) | (to % 8));
+    if (move_type(m) == MOVE_CASTLING)
+        result |= square_bit((to > from) ? from + 3 : from - 4) | square_bit((from + to) / 2);
+    return result;
 }
 
-bool queen_has_way(const struct game *game, struct square from, struct square to)
+void add_move(struct move_list *list, int from, int to, enum move_flag flag)
 {
-    assert((piece_at(game, from) & PIECE_TYPE) == QUEEN && "checking not queen");
-    return bishop_has_way(game, from, to) || rook_has_way(game, from, to);
+    list->moves[list->count++] = encode_move(from, to, flag);
 }
 
-bool king_has_way(const struct game *game, struct square from, struct square to)
+void add_promotions(struct move_list *list, int from, int to)
 {
-    assert((piece_at(game, from) & PIECE_TYPE) == KING && "checking not king");
+    for (int piece = 0; piece < 4; piece++)
+        add_move(list, from, to, MOVE_PROMOTION | piece << 12);
+}
 
-    int file_move = abs(from.file - to.file);
-    int rank_move = abs(from.rank - to.rank);
+/*
+ * All the pieces of both colors attacking the square, with the given occupancy
+ * standing in for the actual one (to look through the moved or captured pieces)
+ */
+bitboard attackers_to(const struct game *game, int square, bitboard occupancy)
+{
+    bitboard bishops = game->pieces[type_index(BISHOP)] | game->pieces[type_index(QUEEN)];
+    bitboard rooks = game->pieces[type_index(ROOK)] | game->pieces[type_index(QUEEN)];
+    bitboard pawns = game->pieces[type_index(PAWN)];
+    return (pawn_attacks[1][square] & pawns & game->colors[0]) |
+           (pawn_attacks[0][square] & pawns & game->colors[1]) |
+           (knight_attacks[square] & game->pieces[type_index(KNIGHT)]) |
+           (king_attacks[square] & game->pieces[type_index(KING)]) |
+           (bishop_attacks(square, occupancy) & bishops) |
+           (rook_attacks(square, occupancy) & rooks);
+}
 
-    // castling
-    if (file_move == 2 && rank_move == 0) {
-        // didn't the king and the rook move?
-        enum piece castling_side = (to.file > from.file) ? KING : QUEEN;
-        enum piece color = piece_at(game, from) & COLOR;
-        if (color == WHITE) {
-            if (!(castling_side & game->white_castling_avail))
-                return false;
-        } else {
-            if (!(castling_side & game->black_castling_avail))
-                return false;
-        }
-        // free squares
-        int direction = (castling_side == QUEEN) ? -1 : 1;
-        struct square rook = {(castling_side == QUEEN) ? 0 : 7, from.rank};
-        struct square rook_to = {(castling_side == QUEEN) ? 3 : 5, from.rank};
-        enum piece opp_color = (color == WHITE) ? BLACK : WHITE;
-        for (int file = from.file + direction; file != rook.file; file += direction)
-            if (game->board[file][from.rank] != EMPTY)
-                return false;
-        // cannot castle when old or intermediate king position is checked
-        if (is_attacked(game, from) || is_attacked_by(game, rook_to, opp_color))
-            return false;
-        return true;
-    }
+// Material values for the exchange evaluation, by type index; the king is never taken
+const int see_values[6] = { 1000, 3000, 3100, 5000, 9000, 0 };
 
-    if (file_move > 1 || rank_move > 1)
+/*
+ * Static exchange evaluation: does the sequence of captures on the destination
+ * square, the least valuable attacker first, win at least 'threshold' for
+ * the side to move? Either side may stop capturing when it is ahead. Sliders
+ * behind the capturers join in as they are uncovered. Special moves are
+ * taken as even exchanges.
+ */
+bool see(const struct game *game, encoded_move m, int threshold)
+{
+    if (move_type(m) != MOVE_NORMAL)
+        return threshold <= 0;
+
+    int from = move_from(m);
+    int to = move_to(m);
+    // what the side to move is ahead of the threshold, as the captures go
+    int swap = (game->mailbox[to] ? see_values[type_index(game->mailbox[to])] : 0) - threshold;
+    if (swap < 0)
         return false;
+    swap = see_values[type_index(game->mailbox[from])] - swap;
+    if (swap <= 0)
+        return true; // even losing the moved piece meets the threshold
+
+    bitboard occupancy = occupied(game) ^ square_bit(from) ^ square_bit(to);
+    bitboard attackers = attackers_to(game, to, occupancy);
+    bitboard bishops = game->pieces[type_index(BISHOP)] | game->pieces[type_index(QUEEN)];
+    bitboard rooks = game->pieces[type_index(ROOK)] | game->pieces[type_index(QUEEN)];
+    enum piece color = game->side_to_move;
+    bool result = true;
+
+    while (true) {
+        color = opposite(color);
+        attackers &= occupancy;
+        bitboard own_attackers = attackers & game->colors[color_index(color)];
+        if (!own_attackers)
+            break;
+        result = !result;
 
-    // A move into check will be checked later
+        int type = 0;
+        while (!(own_attackers & game->pieces[type]))
+            type++;
+        if (type == type_index(KING))
+            // the king may capture only if nothing recaptures it
+            return (attackers & ~game->colors[color_index(color)]) ? !result : result;
 
-    return true;
+        swap = see_values[type] - swap;
+        if (swap < result)
+            break;
+        occupancy ^= square_bit(lsb(own_attackers & game->pieces[type]));
+        if (type == type_index(PAWN) || type == type_index(BISHOP) || type == type_index(QUEEN))
+            attackers |= bishop_attacks(to, occupancy) & bishops;
+        if (type == type_index(ROOK) || type == type_index(QUEEN))
+            attackers |= rook_attacks(to, occupancy) & rooks;
+    }
+    return result;
 }
 
-bool piece_has_way(const struct game *game, struct square from, struct square to)
+// Cache the pieces checking the side to move
+void find_checkers(struct game *game)
 {
-    switch(piece_at(game, from) & PIECE_TYPE) {
-    case PAWN:
-        return pawn_has_way(game, from, to);
+    enum piece color = game->side_to_move;
+    int king = game->king_square[color_index(color)];
+    game->checkers = 0;
+    if (game->attacked_by[color_index(opposite(color))] & square_bit(king))
+        game->checkers = attackers_to(game, king, occupied(game)) &
+                game->colors[color_index(opposite(color))];
+}
 
-    case KNIGHT:
-        return knight_has_way(from, to);
+// Would the move of the side to move leave own king in check?
+bool leaves_king_checked(const struct game *game, encoded_move m)
+{
+    int from = move_from(m);
+    int to = move_to(m);
+    enum piece color = game->side_to_move;
+    bitboard captured = square_bit(to);
+    if (move_type(m) == MOVE_EN_PASSANT)
+        captured = square_bit((from & ~7) | (to % 8));
+    bitboard occupancy = (occupied(game) & ~square_bit(from) & ~captured) | square_bit(to);
+    int king = (game->mailbox[from] & KING) ? to : game->king_square[color_index(color)];
+    bitboard enemy = game->colors[color_index(opposite(color))] & ~captured;
+    return attackers_to(game, king, occupancy) & enemy;
+}
 
-    case BISHOP:
-        return bishop_has_way(game, from, to);
+/*
+ * What the position allows the side to move, found once per generation
+ */
+struct legality {
+    bitboard checkers; // opponent pieces giving check
+    bitboard pinned; // own pieces that may move only along the line to their king
+    bitboard evasion; // destinations blocking or capturing the checker, all if no check
+};
 
-    case ROOK:
-        return rook_has_way(game, from, to);
+void find_legality(const struct game *game, struct legality *legality)
+{
+    enum piece color = game->side_to_move;
+    int king = game->king_square[color_index(color)];
+    bitboard own = game->colors[color_index(color)];
+    bitboard enemy = game->colors[color_index(opposite(color))];
+    bitboard occupancy = own | enemy;
+    bitboard queens = game->pieces[type_index(QUEEN)];
+
+    legality->checkers = game->checkers;
+
+    // a single own piece between the king and an opponent slider is pinned
+    legality->pinned = 0;
+    bitboard snipers = enemy &
+            ((bishop_attacks(king, 0) & (game->pieces[type_index(BISHOP)] | queens)) |
+             (rook_attacks(king, 0) & (game->pieces[type_index(ROOK)] | queens)));
+    while (snipers) {
+        bitboard blockers = between[king][pop_lsb(&snipers)] & occupancy;
+        if (blockers && !(blockers & (blockers - 1)) && (blockers & own))
+            legality->pinned |= blockers;
+    }
 
-    case QUEEN:
-        return queen_has_way(game, from, to);
+    if (legality->checkers == 0)
+        legality->evasion = ~0ULL;
+    else if (popcount(legality->checkers) == 1)
+        legality->evasion = legality->checkers | between[king][lsb(legality->checkers)];
+    else
+        legality->evasion = 0; // double check, only the king can move
+}
 
-    case KING:
-        return king_has_way(game, from, to);
-    }
-    assert(false && "piece_has_way()");
-    return false;
+// Destinations the piece may go to without exposing own king
+static inline bitboard allowed_targets(const struct game *game, const struct legality *legality,
+                                       int from)
+{
+    if (legality->pinned & square_bit(from))
+        return legality->evasion & line[game->king_square[color_index(game->side_to_move)]][from];
+    return legality->evasion;
 }
 
-bool is_attacked_by(const struct game *game, struct square square, enum piece color)
+void generate_pawn_moves(const struct game *game, struct move_list *list,
+                         const struct legality *legality, enum move_generation generation)
 {
-    struct square from;
-    for (from.file = 0; from.file < 8; from.file++) {
-        for (from.rank = 0; from.rank < 8; from.rank++) {
-            enum piece piece = piece_at(game, from);
-            if ((piece & color) && (piece_has_way(game, from, square))) {
-                log_debug("%c%d is attacked by %c%d",
-                    'a' + square.file, 1 + square.rank, 'a' + from.file, 1 + from.rank);
-                return true;
-            }
+    enum piece color = game->side_to_move;
+    bitboard enemy = game->colors[color_index(opposite(color))];
+    bitboard occupancy = occupied(game);
+    int forward = (color == WHITE) ? 8 : -8;
+    int start_rank = (color == WHITE) ? 1 : 6;
+    bitboard last_rank = (color == WHITE) ? RANK_8_BB : RANK_1_BB;
+    // pushes are captures only if they promote
+    bitboard pushes = (generation & CAPTURES) ? last_rank :
+                      (generation & QUIETS) ? ~last_rank : ~0ULL;
+    bitboard captures = (generation & QUIETS) ? 0 : enemy;
+
+    bitboard pawns = pieces_of(game, color|PAWN);
+    while (pawns) {
+        int from = pop_lsb(&pawns);
+        bitboard targets = pawn_attacks[color_index(color)][from] & captures;
+        if (!(occupancy & square_bit(from + forward))) {
+            targets |= square_bit(from + forward) & pushes;
+            if (from / 8 == start_rank && !(occupancy & square_bit(from + 2 * forward)))
+                targets |= square_bit(from + 2 * forward) & pushes;
+        }
+        targets &= allowed_targets(game, legality, from);
+        while (targets) {
+            int to = pop_lsb(&targets);
+            if (square_bit(to) & last_rank)
+                add_promotions(list, from, to);
+            else
+                add_move(list, from, to, MOVE_NORMAL);
+        }
+    }
+
+    if (!(generation & QUIETS)) {
+        int to;
+        bitboard capturers = en_passant_capturers(game, &to);
+        while (capturers) {
+            // two pawns leave the rank at once, so the masks do not cover it: try it out
+            encoded_move m = encode_move(pop_lsb(&capturers), to, MOVE_EN_PASSANT);
+            if (!(generation & LEGAL) || !leaves_king_checked(game, m))
+                list->moves[list->count++] = m;
         }
     }
-    return false;
 }
 
-bool is_attacked(const struct game *game, struct square square)
+void generate_castling(const struct game *game, struct move_list *list)
 {
-    assert(piece_at(game, square) != EMPTY && "is_attacked() empty square");
-    enum piece opp_color = ((piece_at(game, square) & COLOR) == WHITE) ? BLACK : WHITE;
-    return is_attacked_by(game, square, opp_color);
+    enum piece color = game->side_to_move;
+    enum piece avail = (color == WHITE) ? game->white_castling_avail
+                                        : game->black_castling_avail;
+    int king = (color == WHITE) ? 4 : 60;
+    if (avail == EMPTY || game->mailbox[king] != (color|KING))
+        return;
+    if (is_attacked_by(game, index_square(king), opposite(color)))
+        return;
+
+    bitboard occupancy = occupied(game);
+    // the king may not pass or land on an attacked square
+    if ((avail & KING) && game->mailbox[king + 3] == (color|ROOK) &&
+        !(occupancy & (square_bit(king + 1) | square_bit(king + 2))) &&
+        !is_attacked_by(game, index_square(king + 1), opposite(color)) &&
+        !is_attacked_by(game, index_square(king + 2), opposite(color)))
+        add_move(list, king, king + 2, MOVE_CASTLING);
+    if ((avail & QUEEN) && game->mailbox[king - 4] == (color|ROOK) &&
+        !(occupancy & (square_bit(king - 1) | square_bit(king - 2) | square_bit(king - 3))) &&
+        !is_attacked_by(game, index_square(king - 1), opposite(color)) &&
+        !is_attacked_by(game, index_square(king - 2), opposite(color)))
+        add_move(list, king, king - 2, MOVE_CASTLING);
 }
 
-bool is_checked(const struct game *game, enum piece color)
+// Encode a move given by squares, finding out its special kind
+encoded_move encode_squares(const struct game *game, struct square from, struct square to,
+                            enum piece promotion)
 {
-    struct square king;
-    for (king.file = 0; king.file < 8; king.file++)
-        for (king.rank = 0; king.rank < 8; king.rank++)
-            if (game->board[king.file][king.rank] == (KING | color)) {
-                log_debug("king found at %c%d", 'a' + king.file, 0 + king.rank);
-                return is_attacked(game, king);
-            }
-    assert(false && "king not found");
-    return false;
+    enum move_flag flag = MOVE_NORMAL;
+    enum piece piece = piece_at(game, from);
+    if ((piece & KING) && abs(from.file - to.file) == 2)
+        flag = MOVE_CASTLING;
+    else if ((piece & PAWN) && from.file != to.file && piece_at(game, to) == EMPTY)
+        flag = MOVE_EN_PASSANT;
+    else if (promotion & PIECE_TYPE)
+        flag = MOVE_PROMOTION | (type_index(promotion) - 1) << 12;
+    return encode_move(square_index(from), square_index(to), flag);
+}
+
+/*
+ * Move the pieces without any checks: the piece itself, the captured one,
+ * the rook when castling and the pawn taken en passant.
+ * Returns the captured piece or EMPTY.
+ */
+enum piece move_pieces(struct game *game, int from, int to, enum piece promotion)
+{
+    enum piece piece = remove_piece(game, from);
+    enum piece captured = remove_piece(game, to);
+
+    // remove a pawn taken en passant
+    if ((piece & PAWN) && (from % 8 != to % 8) && captured == EMPTY)
+        captured = remove_piece(game, (from & ~7) | (to % 8));
+
+    // moving the rook for castling
+    if ((piece & KING) && abs(to - from) == 2) {
+        int rook_from = (to > from) ? from + 3 : from - 4;
+        put_piece(game, (from + to) / 2, remove_piece(game, rook_from));
+    }
+
+    if (promotion != EMPTY)
+        piece = (promotion & PIECE_TYPE) | (piece & COLOR);
+    put_piece(game, to, piece);
+    return captured;
 }
 
 /*
@@ -422,108 +650,170 @@ bool is_legal_move(const struct game *game, struct square from,
         return false;
     }
     
-    if (piece_at(game, from) == EMPTY) {
-        //log_warning("Must move a piece");
-        return false;
+    // the generator knows all the rules, including castling and en passant
+    struct move_list list;
+    generate_moves(game, &list, LEGAL);
+    for (int i = 0; i < list.count; i++) {
+        encoded_move m = list.moves[i];
+        if (move_from(m) == square_index(from) && move_to(m) == square_index(to) &&
+            move_promotion(m) == (promotion & PIECE_TYPE))
+            return true;
     }
+    return false;
+}
 
-    if ((piece_at(game, from) & COLOR) != game->side_to_move) {
-        //log_warning("Must move own piece");
+/*
+ * Is the encoded move, e.g. remembered from another position, legal here?
+ * Found by the rules of the moving piece, without generating all the moves.
+ */
+bool is_valid_move(const struct game *game, encoded_move m)
+{
+    enum piece color = game->side_to_move;
+    int from = move_from(m);
+    int to = move_to(m);
+    enum piece piece = game->mailbox[from];
+    bitboard own = game->colors[color_index(color)];
+    bitboard enemy = game->colors[color_index(opposite(color))];
+    bitboard occupancy = own | enemy;
+    if (m == NO_MOVE || (piece & COLOR) != color || (own & square_bit(to)))
         return false;
-    }
 
-    if ((piece_at(game, to) & COLOR) == game->side_to_move) {
-        //log_warning("Can't capture own piece");
+    if (move_type(m) == MOVE_CASTLING) {
+        struct move_list list;
+        list.count = 0;
+        if (!game->checkers)
+            generate_castling(game, &list);
+        for (int i = 0; i < list.count; i++)
+            if (list.moves[i] == m)
+                return true;
         return false;
     }
 
-    if (!piece_has_way(game, from, to)) {
-        //log_warning("No way from %c%d to %c%d",
-        //    'a' + from.file, 1 + from.rank, 'a' + to.file, 1 + to.rank);
+    if (piece & PAWN) {
+        int forward = (color == WHITE) ? 8 : -8;
+        int start_rank = (color == WHITE) ? 1 : 6;
+        bitboard last_rank = (color == WHITE) ? RANK_8_BB : RANK_1_BB;
+        bitboard attacks = pawn_attacks[color_index(color)][from];
+        if (move_type(m) == MOVE_EN_PASSANT) {
+            int target;
+            if (!(en_passant_capturers(game, &target) & square_bit(from)) || to != target)
+                return false;
+        } else {
+            if ((move_type(m) == MOVE_PROMOTION) != !!(square_bit(to) & last_rank))
+                return false;
+            bool push = to == from + forward && !(occupancy & square_bit(to));
+            bool double_push = to == from + 2 * forward && from / 8 == start_rank &&
+                    !(occupancy & (square_bit(from + forward) | square_bit(to)));
+            if (!(attacks & enemy & square_bit(to)) && !push && !double_push)
+                return false;
+        }
+    } else if (move_type(m) != MOVE_NORMAL ||
+               !(piece_attacks(piece, from, occupancy) & square_bit(to))) {
         return false;
     }
+    return !leaves_king_checked(game, m);
+}
 
-    int last_rank = (game->side_to_move == WHITE) ? 7 : 0;
-    if ((piece_at(game, from) & PAWN) && (to.rank == last_rank)) {
-        switch (promotion & PIECE_TYPE) {
-        case KNIGHT:
-        case BISHOP:
-        case ROOK:
-        case QUEEN:
-            break;
-        default:
-            //log_warning("Promotion not specified");
-            return false;
+/*
+ * Fill the list with the moves of the side to move. Pseudo-legal moves
+ * are checked only for the piece movement rules; LEGAL moves also keep
+ * own king out of check. Legal moves are found from the checkers and
+ * pinned pieces, without trying the moves out. With CAPTURES, only
+ * the moves changing the material are generated, for quiescence search;
+ * with QUIETS, only the others.
+ */
+void generate_moves(const struct game *game, struct move_list *list,
+                    enum move_generation generation)
+{
+    list->count = 0;
+    enum piece color = game->side_to_move;
+    bitboard own = game->colors[color_index(color)];
+    bitboard enemy = game->colors[color_index(opposite(color))];
+    bitboard occupancy = own | enemy;
+    bitboard destinations = (generation & CAPTURES) ? enemy :
+                            (generation & QUIETS) ? ~occupancy : ~own;
+
+    struct legality legality = { 0, 0, ~0ULL };
+    if (generation & LEGAL)
+        find_legality(game, &legality);
+
+    if (legality.evasion) {
+        generate_pawn_moves(game, list, &legality, generation);
+        for (enum piece type = KNIGHT; type <= QUEEN; type <<= 1) {
+            bitboard pieces = pieces_of(game, color|type);
+            while (pieces) {
+                int from = pop_lsb(&pieces);
+                bitboard targets = piece_attacks(type, from, occupancy) & destinations &
+                        allowed_targets(game, &legality, from);
+                while (targets)
+                    add_move(list, from, pop_lsb(&targets), MOVE_NORMAL);
+            }
         }
     }
-    else
-        if (promotion != EMPTY) {
-            //log_warning("Can't promote");
-            return false;
-        }
 
-    // Isn't own king checked?
-    struct game new_position = *game;
-    new_position.board[to.file][to.rank] = piece_at(game, from);
-    new_position.board[from.file][from.rank] = EMPTY;
-    new_position.side_to_move = (game->side_to_move == WHITE) ? BLACK : WHITE;
-    new_position.en_passant_file = -1;
-    if (is_checked(&new_position, game->side_to_move)) {
-        log_debug("Can't move into check");
-        return false;
+    int king = game->king_square[color_index(color)];
+    bitboard targets = king_attacks[king] & destinations;
+    while (targets) {
+        int to = pop_lsb(&targets);
+        // the king does not shield the squares behind it from a checking slider
+        if (!(generation & LEGAL) ||
+            (!(game->attacked_by[color_index(opposite(color))] & square_bit(to)) &&
+             (!legality.checkers ||
+              !(attackers_to(game, to, occupancy ^ square_bit(king)) & enemy))))
+            add_move(list, king, to, MOVE_NORMAL);
     }
-
-    return true;
+    if (!legality.checkers && !(generation & CAPTURES))
+        generate_castling(game, list);
 }
 
-bool can_make_any_move(const struct game *game)
+/*
+ * Stop at the first legal move found: the king steps first, as they are
+ * the cheapest to check and usually exist, then the pieces, then the pawns.
+ * Castling is never the only legal move, so it is not looked at.
+ */
+bool has_legal_move(const struct game *game)
 {
-    // Not optimal, but neither is performance-critical
-    struct square from;
-    struct square to;
-    for (from.file = 0; from.file < 8; from.file++)
-    for (from.rank = 0; from.rank < 8; from.rank++)
-        if (piece_at(game, from) & game->side_to_move)
-            for (to.file = 0; to.file < 8; to.file++)
-            for (to.rank = 0; to.rank < 8; to.rank++) {
-                enum piece promotion = EMPTY;
-                if ((piece_at(game, from) & PAWN) && (to.rank == 0 || to.rank == 7))
-                    promotion = QUEEN;
-                if (is_legal_move(game, from, to, promotion))
-                    return true;
-            }
-    return false;
-}
-
-bool enough_material(struct game *game)
-{
-    int w_knights = 0, w_bishops = 0;
-    int b_knights = 0, b_bishops = 0;
-    struct square square;
-    for (square.file = 0; square.file < 8; square.file++)
-    for (square.rank = 0; square.rank < 8; square.rank++) {
-        switch (piece_at(game, square)) {
-        case WHITE|PAWN:
-        case WHITE|ROOK:
-        case WHITE|QUEEN:
-        case BLACK|ROOK:
-        case BLACK|PAWN:
-        case BLACK|QUEEN:
+    enum piece color = game->side_to_move;
+    bitboard own = game->colors[color_index(color)];
+    bitboard enemy = game->colors[color_index(opposite(color))];
+    bitboard occupancy = own | enemy;
+
+    int king = game->king_square[color_index(color)];
+    bitboard targets = king_attacks[king] & ~own & ~game->attacked_by[color_index(opposite(color))];
+    while (targets) {
+        int to = pop_lsb(&targets);
+        if (!game->checkers || !(attackers_to(game, to, occupancy ^ square_bit(king)) & enemy))
             return true;
-        case WHITE|KNIGHT:
-            w_knights++;
-            break;
-        case BLACK|KNIGHT:
-            b_knights++;
-            break;
-        case WHITE|BISHOP:
-            w_bishops++;
-            break;
-        case BLACK|BISHOP:
-            b_bishops++;
-            break;
+    }
+
+    struct legality legality;
+    find_legality(game, &legality);
+    if (!legality.evasion)
+        return false;
+    for (enum piece type = KNIGHT; type <= QUEEN; type <<= 1) {
+        bitboard pieces = pieces_of(game, color|type);
+        while (pieces) {
+            int from = pop_lsb(&pieces);
+            if (piece_attacks(type, from, occupancy) & ~own & allowed_targets(game, &legality, from))
+                return true;
         }
     }
+
+    struct move_list list;
+    list.count = 0;
+    generate_pawn_moves(game, &list, &legality, LEGAL);
+    return list.count > 0;
+}
+
+bool enough_material(const struct game *game)
+{
+    if (game->pieces[type_index(PAWN)] | game->pieces[type_index(ROOK)] |
+            game->pieces[type_index(QUEEN)])
+        return true;
+    int w_knights = game->piece_count[0][type_index(KNIGHT)];
+    int b_knights = game->piece_count[1][type_index(KNIGHT)];
+    int w_bishops = game->piece_count[0][type_index(BISHOP)];
+    int b_bishops = game->piece_count[1][type_index(BISHOP)];
     if (w_bishops >= 2 || b_bishops >= 2)
         return true;
     if ((w_bishops == 1 && w_knights >= 1) || (b_bishops == 1 && b_knights >= 1))
@@ -532,92 +822,234 @@ bool enough_material(struct game *game)
 }
 
 /*
- * Make a move, modifying the input game structure (if the move is legal) and
- * returning the result (default, check, checkmate, draw, or illegal move).
+ * Apply a legal move to the position: the pieces, castling availability,
+ * en passant, the fifty-move counter and the side to move.
+ * What is needed to take the move back is saved to 'undo'.
  */
-enum move_result move(struct game *game, struct square from, struct square to,
-                      enum piece promotion)
+void apply_move(struct game *game, encoded_move m, struct undo *undo)
 {
-    if (!is_legal_move(game, from, to, promotion))
-        return ILLEGAL;
-
-    // game setup position
-    if (game->halfmove_clock == 0)
-        game->position_history[0] = hash(game);
-
-    // disabling castling
-    if (from.file == 0 && from.rank == 0)
+    int from = move_from(m);
+    int to = move_to(m);
+    undo->white_castling_avail = game->white_castling_avail;
+    undo->black_castling_avail = game->black_castling_avail;
+    undo->en_passant_file = game->en_passant_file;
+    undo->halfmove_clock = game->halfmove_clock;
+    undo->hash = game->hash;
+    undo->checkers = game->checkers;
+    game->hash ^= en_passant_key(game) ^ castling_keys[castling_index(game)];
+
+    // disabling castling when the king or a rook leaves its square or a rook is taken
+    bitboard touched = square_bit(from) | square_bit(to);
+    if (touched & square_bit(0))
         game->white_castling_avail &= ~QUEEN;
-    if (from.file == 4 && from.rank == 0)
+    if (touched & square_bit(4))
         game->white_castling_avail = EMPTY;
-    if (from.file == 7 && from.rank == 0)
+    if (touched & square_bit(7))
         game->white_castling_avail &= ~KING;
-    if (from.file == 0 && from.rank == 7)
+    if (touched & square_bit(56))
         game->black_castling_avail &= ~QUEEN;
-    if (from.file == 4 && from.rank == 7)
+    if (touched & square_bit(60))
         game->black_castling_avail = EMPTY;
-    if (from.file == 7 && from.rank == 7)
+    if (touched & square_bit(63))
         game->black_castling_avail &= ~KING;
 
-    // moving the rook for castling
-    if ((piece_at(game, from) & KING) && (to.file - from.file == 2)) {
-        game->board[5][from.rank] = game->board[7][from.rank];
-        game->board[7][from.rank] = EMPTY;
-    }
-    if ((piece_at(game, from) & KING) && (to.file - from.file == -2)) {
-        game->board[3][from.rank] = game->board[0][from.rank];
-        game->board[0][from.rank] = EMPTY;
-    }
-
     // en passant availability
+    enum piece piece = game->mailbox[from];
     game->en_passant_file = -1;
-    if ((piece_at(game, from) & PAWN) && abs(from.rank - to.rank) == 2) {
-        log_debug("Available en passant at file %c", 'a' + from.file);
-        game->en_passant_file = from.file;
-    }
+    if ((piece & PAWN) && abs(from - to) == 16)
+        game->en_passant_file = from % 8;
+
+    // move the pieces
+    enum piece captured = move_pieces(game, from, to, move_promotion(m));
+    undo->captured = captured;
+    update_attacks(game, changed_squares(m));
+    game->side_to_move = opposite(game->side_to_move);
+    game->hash ^= en_passant_key(game) ^ castling_keys[castling_index(game)] ^ black_to_move_key;
 
     // track the fifty-move rule
     game->halfmove_clock++;
-    if (piece_at(game, from) & PAWN || piece_at(game, to) != EMPTY)
+    if ((piece & PAWN) || captured != EMPTY)
         game->halfmove_clock = 0;
 
-    // move the piece
-    game->board[to.file][to.rank] = game->board[from.file][from.rank];
-    game->board[from.file][from.rank] = EMPTY;
-    if (promotion != EMPTY)
-        game->board[to.file][to.rank] = ((promotion & ~COLOR) | game->side_to_move);
-    game->side_to_move = (game->side_to_move == WHITE) ? BLACK : WHITE;
+    find_checkers(game);
+}
 
-    // remove a pawn taken en passant
-    if ((piece_at(game, from) & PAWN) && (from.file != to.file) &&
-            (piece_at(game, to) == EMPTY)) {
-        game->board[to.file][from.rank] == EMPTY;
+/*
+ * Take back the move made by apply_move() with the same undo record
+ */
+void undo_move(struct game *game, encoded_move m, const struct undo *undo)
+{
+    int from = move_from(m);
+    int to = move_to(m);
+    game->side_to_move = opposite(game->side_to_move);
+
+    enum piece piece = remove_piece(game, to);
+    if (move_type(m) == MOVE_PROMOTION)
+        piece = game->side_to_move|PAWN;
+    put_piece(game, from, piece);
+
+    if (move_type(m) == MOVE_CASTLING) {
+        int rook_from = (to > from) ? from + 3 : from - 4;
+        put_piece(game, rook_from, remove_piece(game, (from + to) / 2));
     }
 
-    game->position_history[game->halfmove_clock] = hash(game);
-    int repetitions = 0;
-    for (int move = 0; move <= game->halfmove_clock; move++)
-        if (game->position_history[move] == game->position_history[game->halfmove_clock])
-            repetitions++;
-    if (repetitions == 3)
-        return DRAW;
+    if (undo->captured != EMPTY) {
+        int captured_square = to;
+        if (move_type(m) == MOVE_EN_PASSANT)
+            captured_square = (from & ~7) | (to % 8);
+        put_piece(game, captured_square, undo->captured);
+    }
+    update_attacks(game, changed_squares(m));
+
+    game->white_castling_avail = undo->white_castling_avail;
+    game->black_castling_avail = undo->black_castling_avail;
+    game->en_passant_file = undo->en_passant_file;
+    game->halfmove_clock = undo->halfmove_clock;
+    game->hash = undo->hash;
+    game->checkers = undo->checkers;
+}
 
+// Record the current position in the history, if attached
+void push_history(struct game *game)
+{
+    struct history *history = game->history;
+    if (history != NULL) {
+        // only the reversible moves are ever looked at, keep the recent ones
+        if (history->count == MAX_HISTORY) {
+            memmove(history->keys, history->keys + MAX_HISTORY - 256, 256 * sizeof(uint64_t));
+            history->count = 256;
+        }
+        history->keys[history->count++] = game->hash;
+    }
+}
+
+/*
+ * Make a legal move from the move generator, modifying the input game
+ * structure in place. unmake_move() restores the position from 'undo'.
+ * The game result is not computed; ask classify_position() when needed.
+ */
+void make_move(struct game *game, encoded_move m, struct undo *undo)
+{
+    apply_move(game, m, undo);
+    push_history(game);
+}
+
+/*
+ * Take back the move made by make_move() with the same undo record
+ */
+void unmake_move(struct game *game, encoded_move m, const struct undo *undo)
+{
+    undo_move(game, m, undo);
+    if (game->history != NULL)
+        game->history->count--;
+}
+
+/*
+ * Pass the move to the opponent, for the null move search. The side to move
+ * must not be in check. The fifty-move counter is restarted, so that
+ * a repetition is not found across the null move.
+ */
+void make_null_move(struct game *game, struct undo *undo)
+{
+    undo->en_passant_file = game->en_passant_file;
+    undo->halfmove_clock = game->halfmove_clock;
+    undo->hash = game->hash;
+    undo->checkers = game->checkers;
+    game->hash ^= en_passant_key(game);
+    game->en_passant_file = -1;
+    game->side_to_move = opposite(game->side_to_move);
+    game->hash ^= black_to_move_key;
+    game->halfmove_clock = 0;
+    game->checkers = 0;
+    push_history(game);
+}
+
+void unmake_null_move(struct game *game, const struct undo *undo)
+{
+    game->side_to_move = opposite(game->side_to_move);
+    game->en_passant_file = undo->en_passant_file;
+    game->halfmove_clock = undo->halfmove_clock;
+    game->hash = undo->hash;
+    game->checkers = undo->checkers;
+    if (game->history != NULL)
+        game->history->count--;
+}
+
+// Attach the history storage to the game, starting with its current position
+void start_history(struct game *game, struct history *history)
+{
+    history->keys[0] = game->hash;
+    history->count = 1;
+    game->history = history;
+}
+
+/*
+ * Has the position occurred before? A single repetition within the last
+ * 'ply' plies (the search tree) is enough; an earlier position must have
+ * occurred twice, as the threefold repetition rule requires. Only the
+ * positions since the last capture or pawn move with the same side to
+ * move can repeat, so every other one since then is compared.
+ */
+bool is_repetition(const struct game *game, int ply)
+{
+    const struct history *history = game->history;
+    if (history == NULL)
+        return false;
+    int last = history->count - 1;
+    int reversible = (game->halfmove_clock < last) ? game->halfmove_clock : last;
+    int occurrences = 0;
+    for (int back = 4; back <= reversible; back += 2)
+        if (history->keys[last - back] == game->hash) {
+            if (back <= ply || ++occurrences == 2)
+                return true;
+        }
+    return false;
+}
+
+// Has the current position occurred for the third time?
+bool is_threefold_repetition(const struct game *game)
+{
+    return is_repetition(game, 0);
+}
+
+/*
+ * Result of the last move made: default, check, checkmate or draw
+ */
+enum move_result classify_position(const struct game *game)
+{
+    if (is_threefold_repetition(game))
+        return DRAW;
     if (!enough_material(game))
         return DRAW;
-    if (!can_make_any_move(game)) {
-        if (is_checked(game, game->side_to_move))
+    if (!has_legal_move(game)) {
+        if (game->checkers)
             return CHECKMATE;
         else
             return DRAW;
     }
-    if (game->halfmove_clock == 100)
+    if (game->halfmove_clock >= 100)
         return DRAW;
-    if (is_checked(game, game->side_to_move))
+    if (game->checkers)
         return CHECK;
-        
+
     return DEFAULT;
 } 
 
+/*
+ * Make a move, modifying the input game structure (if the move is legal) and
+ * returning the result (default, check, checkmate, draw, or illegal move).
+ */
+enum move_result move(struct game *game, struct square from, struct square to,
+                      enum piece promotion)
+{
+    if (!is_legal_move(game, from, to, promotion))
+        return ILLEGAL;
+
+    struct undo undo;
+    make_move(game, encode_squares(game, from, to, promotion), &undo);
+    return classify_position(game);
+}
+
 enum move_result parse_move(struct game *game, char *move_str)
 {
     // strip newline characters
@@ -645,3 +1077,33 @@ enum move_result parse_move(struct game *game, char *move_str)
 
     return move(game, from, to, promotion);
 }
+
+/*
+ * Performance test: count the leaf nodes of the legal move tree.
+ * Terminal positions (mates, draws by rule) are not stopped at,
+ * as the reference numbers count them the same way.
+ */
+unsigned long long perft_recursive(struct game *game, int depth)
+{
+    struct move_list list;
+    generate_moves(game, &list, LEGAL);
+    if (depth == 1)
+        return list.count;
+
+    unsigned long long nodes = 0;
+    for (int i = 0; i < list.count; i++) {
+        struct undo undo;
+        apply_move(game, list.moves[i], &undo);
+        nodes += perft_recursive(game, depth - 1);
+        undo_move(game, list.moves[i], &undo);
+    }
+    return nodes;
+}
+
+unsigned long long perft_nodes(const struct game *game, int depth)
+{
+    if (depth == 0)
+        return 1;
+    struct game position = *game;
+    return perft_recursive(&position, depth);
+}
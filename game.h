@@ -2,6 +2,9 @@
 #define GAME_H
 
 #include <stdbool.h>
+#include <stdint.h>
+
+#include "bitboard.h"
 
 enum piece {
     EMPTY      = 0x00,
@@ -27,31 +30,183 @@ enum move_result {
     ILLEGAL,
 };
 
+struct square {
+    int file;
+    int rank;
+};
+
+#define MAX_HISTORY 1024
+
+/*
+ * Hashes of the positions played in the game, and in the search on top of it,
+ * the current one last. Shared by the copies of a game; make_move() pushes
+ * and unmake_move() pops.
+ */
+struct history {
+    uint64_t keys[MAX_HISTORY];
+    int count;
+};
+
+/*
+ * The position is kept twice: as bitboards for the rules and as a mailbox
+ * for the "what is on this square" questions. Both are updated together,
+ * as well as the piece counts, the king squares and the attack maps.
+ */
 struct game {
-    enum piece board[8][8];
+    bitboard pieces[6]; // by piece type, from pawns to kings
+    bitboard colors[2]; // by color, white and black
+    uint8_t mailbox[64]; // enum piece values, a1 = 0, h8 = 63
+    uint8_t piece_count[2][6]; // by color and piece type
+    uint8_t king_square[2]; // by color
+    bitboard attacks_from[64]; // squares attacked by the piece standing on each square
+    bitboard attacked_by[2]; // squares attacked by each color
+    bitboard checkers; // pieces giving check to the side to move
     enum piece side_to_move; // WHITE or BLACK
     enum piece white_castling_avail; // QUEEN|KING for kingside and queenside
     enum piece black_castling_avail;
     int en_passant_file;
     int halfmove_clock; // track fifty-move rule
-    int position_history[256]; // keep hashes to track threefold repetition
+    uint64_t hash; // Zobrist key, kept up to date by make_move()
+    struct history *history; // positions played, kept outside; may be NULL
 };
 
-struct square {
-    int file;
-    int rank;
+/*
+ * A move packed into 16 bits: the origin square in bits 0-5, the destination
+ * in bits 6-11, the promoted piece (knight to queen) in bits 12-13 and
+ * the special move kind in bits 14-15.
+ */
+typedef uint16_t encoded_move;
+
+#define NO_MOVE 0
+
+enum move_flag {
+    MOVE_NORMAL     = 0x0000,
+    MOVE_PROMOTION  = 0x4000,
+    MOVE_EN_PASSANT = 0x8000,
+    MOVE_CASTLING   = 0xC000,
+    MOVE_FLAGS      = 0xC000,
+};
+
+#define MAX_MOVES 256 // no position has more legal moves
+
+struct move_list {
+    encoded_move moves[MAX_MOVES];
+    int count;
 };
 
-extern const struct game setup; // starting position
+/*
+ * What make_move() saves for unmake_move() to restore the position
+ */
+struct undo {
+    uint8_t captured; // enum piece
+    uint8_t white_castling_avail;
+    uint8_t black_castling_avail;
+    int8_t en_passant_file;
+    int halfmove_clock;
+    uint64_t hash;
+    bitboard checkers;
+};
+
+enum move_generation {
+    PSEUDO_LEGAL = 0x00, // moves may leave own king in check
+    LEGAL        = 0x01,
+    CAPTURES     = 0x02, // only captures and promotions, no castling
+    QUIETS       = 0x04, // only the rest of the moves
+};
+
+extern struct game setup; // starting position, complete after game_init()
 extern const char *move_result_text[];
 
+// Square index in bitboards and the mailbox
+static inline int square_index(struct square square)
+{
+    return square.rank * 8 + square.file;
+}
+
+static inline struct square index_square(int index)
+{
+    return (struct square){ index % 8, index / 8 };
+}
+
+// Index in game.pieces[]: PAWN is 0, KING is 5
+static inline int type_index(enum piece piece)
+{
+    return __builtin_ctz(piece & PIECE_TYPE) - 2;
+}
+
+// Index in game.colors[]: WHITE is 0, BLACK is 1
+static inline int color_index(enum piece piece)
+{
+    return (piece & COLOR) - 1;
+}
+
+static inline enum piece opposite(enum piece color)
+{
+    return color ^ COLOR;
+}
+
+// Pieces of the given type and color, e.g. pieces_of(game, BLACK|KNIGHT)
+static inline bitboard pieces_of(const struct game *game, enum piece piece)
+{
+    return game->pieces[type_index(piece)] & game->colors[color_index(piece)];
+}
+
+static inline bitboard occupied(const struct game *game)
+{
+    return game->colors[0] | game->colors[1];
+}
+
+static inline encoded_move encode_move(int from, int to, enum move_flag flag)
+{
+    return from | to << 6 | flag;
+}
+
+static inline int move_from(encoded_move m)
+{
+    return m & 63;
+}
+
+static inline int move_to(encoded_move m)
+{
+    return (m >> 6) & 63;
+}
+
+static inline enum move_flag move_type(encoded_move m)
+{
+    return m & MOVE_FLAGS;
+}
+
+// The promoted piece type or EMPTY
+static inline enum piece move_promotion(encoded_move m)
+{
+    return (m & MOVE_FLAGS) == MOVE_PROMOTION ? KNIGHT << ((m >> 12) & 3) : EMPTY;
+}
+
+void game_init();
 struct game* fen_to_game(char *fen);
+uint64_t hash(const struct game *game);
 enum piece piece_at(const struct game *game, struct square square);
-bool piece_has_way(const struct game *game, struct square from, struct square to);
+bitboard piece_attacks(enum piece type, int square, bitboard occupancy);
+bitboard attackers_to(const struct game *game, int square, bitboard occupancy);
+bool see(const struct game *game, encoded_move m, int threshold);
+void generate_moves(const struct game *game, struct move_list *list,
+                    enum move_generation generation);
+void make_move(struct game *game, encoded_move m, struct undo *undo);
+void unmake_move(struct game *game, encoded_move m, const struct undo *undo);
+void make_null_move(struct game *game, struct undo *undo);
+void unmake_null_move(struct game *game, const struct undo *undo);
+bool has_legal_move(const struct game *game);
+bool enough_material(const struct game *game);
+void start_history(struct game *game, struct history *history);
+bool is_repetition(const struct game *game, int ply);
+bool is_threefold_repetition(const struct game *game);
+enum move_result classify_position(const struct game *game);
 bool is_legal_move(const struct game *game, struct square from,
                    struct square to, enum piece promotion);
+bool is_valid_move(const struct game *game, encoded_move m);
 enum move_result move(struct game *game, struct square from,
                       struct square to, enum piece promotion);
 enum move_result parse_move(struct game *game, char *move);
+unsigned long long perft_nodes(const struct game *game, int depth);
 char* move_result_to_string(enum move_result move_result);
 #endif // GAME_H
@@ -8,6 +8,7 @@
 #include "game.h"
 #include "log.h"
 #include "test.h"
+#include "tt.h"
 #include "uci.h"
 
 const struct option long_options[] = {
@@ -31,6 +32,7 @@ const char usage[] =
     "Enter moves like e2e4 or e7e8q (with promotion).";
 
 const int max_move_length = 256;
+const int computer_move_time = 1000; // milliseconds
 
 /*
 // Parse fuzzy format. Examples:
@@ -116,6 +118,8 @@ void run_game()
     puts("Enter q to quit");
     log_info("Game started");
     struct game game = setup;
+    struct history history;
+    start_history(&game, &history);
     do {
         enum move_result result;
         if (game.side_to_move == WHITE) {
@@ -128,7 +132,8 @@ void run_game()
         } else {
             struct square from, to;
             enum piece promotion;
-            best_move(&game, 2, &from, &to, &promotion);
+            struct search_limits limits = { .move_time = computer_move_time };
+            think(&game, &limits, &from, &to, &promotion);
             char promotion_char;
             switch (promotion) {
             case EMPTY:  promotion_char = ' '; break;
@@ -163,6 +168,11 @@ void run_game()
 
 int main(int argc, char **argv)
 {
+    game_init();
+    ai_init();
+    if (!tt_resize(TT_DEFAULT_SIZE))
+        return 1;
+
     // Parse the command line arguments
     int arg = 0;
     do {
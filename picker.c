@@ -0,0 +1,238 @@
+#include <string.h>
+
+#include "picker.h"
+
+const int score_capture = 1 << 28; // evasions: captures before the quiet moves
+
+// Victim values for MVV-LVA, by type index; en passant takes a pawn
+const int victim_values[6] = { 1, 3, 3, 5, 9, 0 };
+
+// Captures and promotions, the moves generated with CAPTURES
+bool is_capture(const struct game *game, encoded_move m)
+{
+    return game->mailbox[move_to(m)] != EMPTY || move_type(m) == MOVE_EN_PASSANT ||
+            move_type(m) == MOVE_PROMOTION;
+}
+
+// Forget the killers and the countermoves, halve the history
+void clear_heuristics(struct heuristics *heuristics)
+{
+    memset(heuristics->killers, 0, sizeof heuristics->killers);
+    memset(heuristics->countermoves, 0, sizeof heuristics->countermoves);
+    memset(heuristics->played, 0, sizeof heuristics->played);
+    for (int color = 0; color < 2; color++)
+    for (int from = 0; from < 64; from++)
+    for (int to = 0; to < 64; to++)
+        heuristics->history[color][from][to] /= 2;
+}
+
+// The countermove slot for the opponent's last move, NULL at the root
+static inline encoded_move* countermove(struct heuristics *heuristics,
+                                        const struct game *game, int ply)
+{
+    if (ply == 0 || heuristics->played[ply - 1] == NO_MOVE)
+        return NULL;
+    int square = move_to(heuristics->played[ply - 1]);
+    enum piece piece = game->mailbox[square];
+    return &heuristics->countermoves[color_index(piece)][type_index(piece)][square];
+}
+
+// MVV-LVA: the most valuable victim first, of those the least valuable attacker
+int capture_score(const struct game *game, encoded_move m)
+{
+    enum piece victim = game->mailbox[move_to(m)];
+    int score = 8 * (victim != EMPTY ? victim_values[type_index(victim)] : 1) -
+            type_index(game->mailbox[move_from(m)]);
+    if (move_type(m) == MOVE_PROMOTION)
+        score += 8 * victim_values[type_index(move_promotion(m))];
+    return score;
+}
+
+void score_moves(struct move_picker *picker)
+{
+    const struct game *game = picker->game;
+    int color = color_index(game->side_to_move);
+    for (int i = 0; i < picker->list.count; i++) {
+        encoded_move m = picker->list.moves[i];
+        if (is_capture(game, m))
+            picker->scores[i] = score_capture + capture_score(game, m);
+        else
+            picker->scores[i] = picker->heuristics->history[color][move_from(m)][move_to(m)];
+    }
+}
+
+/*
+ * Get ready to hand out the moves of the position: the transposition table
+ * move first, then the captures and promotions by MVV-LVA, then the killers
+ * and the countermove, the rest of the quiet moves by history, and last
+ * the captures losing material by the static exchange evaluation. With
+ * CAPTURES, only the captures not losing material are handed out. A side
+ * in check gets all its evasions, captures first.
+ */
+void init_picker(struct move_picker *picker, const struct game *game,
+                 struct heuristics *heuristics, encoded_move tt_move, int ply,
+                 enum move_generation generation)
+{
+    picker->game = game;
+    picker->heuristics = heuristics;
+    picker->ply = ply;
+    picker->captures_only = generation & CAPTURES;
+    picker->skip_quiets = false;
+    picker->tt_move = tt_move;
+    picker->stage = STAGE_TT_MOVE;
+    picker->list.count = picker->next = 0;
+    picker->bad_captures.count = picker->next_bad = 0;
+
+    encoded_move *counter = countermove(heuristics, game, ply);
+    picker->refutations[0] = heuristics->killers[ply][0];
+    picker->refutations[1] = heuristics->killers[ply][1];
+    picker->refutations[2] = counter != NULL && *counter != picker->refutations[0] &&
+            *counter != picker->refutations[1] ? *counter : NO_MOVE;
+}
+
+// Select the best scored move of the rest of the list; NO_MOVE when all are out
+encoded_move select_best(struct move_picker *picker)
+{
+    if (picker->next == picker->list.count)
+        return NO_MOVE;
+    int best = picker->next;
+    for (int i = best + 1; i < picker->list.count; i++)
+        if (picker->scores[i] > picker->scores[best])
+            best = i;
+
+    encoded_move m = picker->list.moves[best];
+    int score = picker->scores[best];
+    picker->list.moves[best] = picker->list.moves[picker->next];
+    picker->scores[best] = picker->scores[picker->next];
+    picker->list.moves[picker->next] = m;
+    picker->scores[picker->next] = score;
+    picker->next++;
+    return m;
+}
+
+bool is_refutation(const struct move_picker *picker, encoded_move m)
+{
+    return m == picker->refutations[0] || m == picker->refutations[1] ||
+            m == picker->refutations[2];
+}
+
+/*
+ * Hand out the next move, generating the moves of the next stage when
+ * the ones of the current stage are out; NO_MOVE when all are out.
+ * Moves are rarely all needed, so they are selected, not sorted.
+ */
+encoded_move next_move(struct move_picker *picker)
+{
+    const struct game *game = picker->game;
+    encoded_move m;
+    switch (picker->stage) {
+    case STAGE_TT_MOVE:
+        picker->stage = game->checkers ? STAGE_GENERATE_EVASIONS : STAGE_GENERATE_CAPTURES;
+        if (picker->tt_move != NO_MOVE &&
+                (!picker->captures_only || game->checkers || is_capture(game, picker->tt_move)) &&
+                is_valid_move(game, picker->tt_move))
+            return picker->tt_move;
+        return next_move(picker);
+
+    case STAGE_GENERATE_CAPTURES:
+        generate_moves(game, &picker->list, LEGAL|CAPTURES);
+        picker->next = 0;
+        score_moves(picker);
+        picker->stage = STAGE_GOOD_CAPTURES;
+        // fall through
+    case STAGE_GOOD_CAPTURES:
+        while ((m = select_best(picker)) != NO_MOVE) {
+            if (m == picker->tt_move)
+                continue;
+            if (see(game, m, 0))
+                return m;
+            if (!picker->captures_only)
+                picker->bad_captures.moves[picker->bad_captures.count++] = m;
+        }
+        if (picker->captures_only) {
+            picker->stage = STAGE_DONE;
+            return NO_MOVE;
+        }
+        picker->stage = STAGE_KILLERS;
+        picker->next = 0;
+        // fall through
+    case STAGE_KILLERS:
+        while (picker->next < 3 && !picker->skip_quiets) {
+            m = picker->refutations[picker->next++];
+            if (m != NO_MOVE && m != picker->tt_move && !is_capture(game, m) &&
+                    is_valid_move(game, m))
+                return m;
+        }
+        picker->stage = STAGE_GENERATE_QUIETS;
+        // fall through
+    case STAGE_GENERATE_QUIETS:
+        if (picker->skip_quiets)
+            picker->list.count = 0;
+        else
+            generate_moves(game, &picker->list, LEGAL|QUIETS);
+        picker->next = 0;
+        score_moves(picker);
+        picker->stage = STAGE_QUIETS;
+        // fall through
+    case STAGE_QUIETS:
+        while (!picker->skip_quiets && (m = select_best(picker)) != NO_MOVE)
+            if (m != picker->tt_move && !is_refutation(picker, m))
+                return m;
+        picker->stage = STAGE_BAD_CAPTURES;
+        // fall through
+    case STAGE_BAD_CAPTURES:
+        if (picker->next_bad < picker->bad_captures.count)
+            return picker->bad_captures.moves[picker->next_bad++];
+        picker->stage = STAGE_DONE;
+        return NO_MOVE;
+
+    case STAGE_GENERATE_EVASIONS:
+        generate_moves(game, &picker->list, LEGAL);
+        picker->next = 0;
+        score_moves(picker);
+        picker->stage = STAGE_EVASIONS;
+        // fall through
+    case STAGE_EVASIONS:
+        while ((m = select_best(picker)) != NO_MOVE)
+            if (m != picker->tt_move)
+                return m;
+        picker->stage = STAGE_DONE;
+        // fall through
+    case STAGE_DONE:
+        return NO_MOVE;
+    }
+    return NO_MOVE;
+}
+
+// Move the history towards the bonus, the closer to the limit the slower
+static inline void update_history(int *history, int bonus)
+{
+    *history += bonus - (long long)*history * (bonus < 0 ? -bonus : bonus) / HISTORY_MAX;
+}
+
+/*
+ * Learn from a quiet move that caused a beta cutoff: make it a killer and
+ * the countermove, raise its history and lower the history of the quiet
+ * moves searched before it in vain.
+ */
+void update_heuristics(struct heuristics *heuristics, const struct game *game, int ply,
+                       int depth, encoded_move best, const encoded_move *quiets, int n_quiets)
+{
+    encoded_move *killers = heuristics->killers[ply];
+    if (killers[0] != best) {
+        killers[1] = killers[0];
+        killers[0] = best;
+    }
+
+    encoded_move *counter = countermove(heuristics, game, ply);
+    if (counter != NULL)
+        *counter = best;
+
+    int color = color_index(game->side_to_move);
+    int bonus = depth * depth * 16 < 16000 ? depth * depth * 16 : 16000;
+    update_history(&heuristics->history[color][move_from(best)][move_to(best)], bonus);
+    for (int i = 0; i < n_quiets; i++)
+        if (quiets[i] != best)
+            update_history(&heuristics->history[color][move_from(quiets[i])][move_to(quiets[i])],
+                           -bonus);
+}
@@ -0,0 +1,64 @@
+#ifndef PICKER_H
+#define PICKER_H
+
+#include "ai.h"
+#include "game.h"
+
+#define HISTORY_MAX (1 << 20) // keeps the history below the capture scores
+
+/*
+ * What the search learns about the quiet moves: killers refuted a sibling
+ * position at the same ply, a countermove refuted the opponent's last move,
+ * the history counts the cutoffs of a move by its squares.
+ */
+struct heuristics {
+    encoded_move killers[MAX_PLY][2];
+    encoded_move countermoves[2][6][64]; // by the color, type and square of the last move's piece
+    int history[2][64][64]; // by color, origin and destination, within +-HISTORY_MAX
+    encoded_move played[MAX_PLY]; // the move searched at each ply
+};
+
+enum picker_stage {
+    STAGE_TT_MOVE,
+    STAGE_GENERATE_CAPTURES,
+    STAGE_GOOD_CAPTURES,
+    STAGE_KILLERS,
+    STAGE_GENERATE_QUIETS,
+    STAGE_QUIETS,
+    STAGE_BAD_CAPTURES,
+    STAGE_GENERATE_EVASIONS,
+    STAGE_EVASIONS,
+    STAGE_DONE,
+};
+
+/*
+ * Hands out the moves of a position the most promising first, generating
+ * them in stages: a cutoff by the table move needs no generation at all,
+ * a cutoff by a capture or a killer needs no quiet moves.
+ */
+struct move_picker {
+    const struct game *game;
+    struct heuristics *heuristics;
+    encoded_move tt_move;
+    encoded_move refutations[3]; // killers and the countermove
+    int ply;
+    bool captures_only; // for quiescence search, without the losing captures
+    bool skip_quiets; // set by the search to prune the quiet moves left
+    enum picker_stage stage;
+    struct move_list list; // of the current stage
+    int scores[MAX_MOVES];
+    int next; // moves of the list before it were handed out
+    struct move_list bad_captures; // postponed to the end
+    int next_bad;
+};
+
+void clear_heuristics(struct heuristics *heuristics);
+void init_picker(struct move_picker *picker, const struct game *game,
+                 struct heuristics *heuristics, encoded_move tt_move, int ply,
+                 enum move_generation generation);
+encoded_move next_move(struct move_picker *picker);
+void update_heuristics(struct heuristics *heuristics, const struct game *game, int ply,
+                       int depth, encoded_move best, const encoded_move *quiets, int n_quiets);
+bool is_capture(const struct game *game, encoded_move m);
+
+#endif // PICKER_H
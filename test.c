@@ -2,10 +2,13 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #include "ai.h"
 #include "log.h"
+#include "picker.h"
 #include "test.h"
+#include "tt.h"
 #include "uci.h"
 
 /*
@@ -23,6 +26,8 @@ int run_raw_file(const char *filename, enum move_result *result)
     *result = DEFAULT;
     int halfmoves = 0;
     struct game game = setup;
+    struct history history;
+    start_history(&game, &history);
     char move[6];
     while (fscanf(file, "%5s", move) == 1) {
         printf("%s ", move); 
@@ -67,11 +72,7 @@ int test_game(const char *test_name, int moves_expected, enum move_result result
 
 int test_perft(struct game *game, int depth, int result_expected)
 {
-    struct square from, to;
-    enum piece promotion;
-    int score = best_move(game, depth, &from, &to, &promotion);
-    printf("score %d, move %c%d%c%d %d\n", score, from.file + 'a', from.rank + 1, to.file + 'a', to.rank + 1, promotion);
-    if (perft == result_expected) {
+    if (perft_nodes(game, depth) == result_expected) {
         log_notice("A perft(%d) test passed.", depth);
         return 0;
     } else {
@@ -80,6 +81,304 @@ int test_perft(struct game *game, int depth, int result_expected)
     }
 }
 
+// The game of a FEN position; NULL, with the error logged, if the FEN is incorrect
+static struct game* load_fen(const char *fen)
+{
+    char fen_copy[128]; // fen_to_game() takes a writable string
+    size_t length = strlen(fen);
+    struct game *game = NULL;
+    if (length < sizeof fen_copy) {
+        memcpy(fen_copy, fen, length + 1);
+        game = fen_to_game(fen_copy);
+    }
+    if (game == NULL)
+        log_err("Incorrect FEN '%s'", fen);
+    return game;
+}
+
+// Count the move tree leaves of a FEN position against the reference number
+int test_perft_fen(const char *fen, int depth, unsigned long long result_expected)
+{
+    struct game *game = load_fen(fen);
+    if (game == NULL)
+        return -1;
+    unsigned long long nodes = perft_nodes(game, depth);
+    free(game);
+    if (nodes == result_expected) {
+        log_notice("A perft(%d) test passed.", depth);
+        return 0;
+    } else {
+        log_err("A perft(%d) test of '%s' failed: expected %llu, actual is %llu.",
+                depth, fen, result_expected, nodes);
+        return -1;
+    }
+}
+
+// Is the move one of the list, in the order of the moves checked before?
+bool next_in_list(const struct move_list *list, int *index, encoded_move m)
+{
+    return *index < list->count && list->moves[(*index)++] == m;
+}
+
+// Walk the move tree comparing the incremental hash and attack maps
+// with the ones computed from scratch, the captures and quiet moves
+// generated with the ones among all the moves, and the moves found valid
+// (the ones of the two positions before too) with the ones generated;
+// a null move must keep the hash right too
+int check_incremental_tree(struct game *game, int depth, const struct move_list *earlier_lists[2])
+{
+    if (game->hash != hash(game))
+        return -1;
+    for (int square = 0; square < 64; square++) {
+        bitboard attackers = attackers_to(game, square, occupied(game));
+        for (int color = 0; color < 2; color++)
+            if (!(attackers & game->colors[color]) != !(game->attacked_by[color] & square_bit(square)))
+                return -1;
+    }
+    if (!game->checkers) {
+        struct undo undo;
+        uint64_t key = game->hash;
+        make_null_move(game, &undo);
+        bool passed = game->hash == hash(game) && game->checkers == 0;
+        unmake_null_move(game, &undo);
+        if (!passed || game->hash != key)
+            return -1;
+    }
+
+    struct move_list list, captures, quiets;
+    generate_moves(game, &list, LEGAL);
+    generate_moves(game, &captures, LEGAL|CAPTURES);
+    generate_moves(game, &quiets, LEGAL|QUIETS);
+    int n_captures = 0, n_quiets = 0;
+    for (int i = 0; i < list.count; i++) {
+        encoded_move m = list.moves[i];
+        bool capture = game->mailbox[move_to(m)] != EMPTY || move_type(m) == MOVE_EN_PASSANT ||
+                move_type(m) == MOVE_PROMOTION;
+        if (!next_in_list(capture ? &captures : &quiets, capture ? &n_captures : &n_quiets, m) ||
+                !is_valid_move(game, m))
+            return -1;
+    }
+    if (n_captures != captures.count || n_quiets != quiets.count)
+        return -1;
+    for (int k = 0; k < 2; k++)
+    for (int i = 0; i < earlier_lists[k]->count; i++) {
+        encoded_move m = earlier_lists[k]->moves[i];
+        bool listed = false;
+        for (int j = 0; j < list.count; j++)
+            listed = listed || list.moves[j] == m;
+        if (is_valid_move(game, m) != listed)
+            return -1;
+    }
+
+    if (depth == 0)
+        return 0;
+    for (int i = 0; i < list.count; i++) {
+        struct undo undo;
+        make_move(game, list.moves[i], &undo);
+        const struct move_list *lists[2] = { earlier_lists[1], &list };
+        int result = check_incremental_tree(game, depth - 1, lists);
+        unmake_move(game, list.moves[i], &undo);
+        if (result != 0)
+            return result;
+    }
+    return 0;
+}
+
+int test_incremental(const char *fen, int depth)
+{
+    struct game *game = load_fen(fen);
+    if (game == NULL)
+        return -1;
+    struct move_list no_moves = { .count = 0 };
+    const struct move_list *lists[2] = { &no_moves, &no_moves };
+    int result = check_incremental_tree(game, depth, lists);
+    free(game);
+    if (result == 0) {
+        log_notice("An incremental update test passed.");
+        return 0;
+    } else {
+        log_err("An incremental update test of '%s' failed.", fen);
+        return -1;
+    }
+}
+
+// Search a FEN position within the limits and compare the best move found
+// with the expected one; a move time must be kept
+int test_search(const char *fen, struct search_limits limits, const char *move_expected)
+{
+    struct game *game = load_fen(fen);
+    if (game == NULL)
+        return -1;
+    struct history history;
+    start_history(game, &history);
+    struct square from, to;
+    enum piece promotion;
+    long long start = now();
+    int score = think(game, &limits, &from, &to, &promotion);
+    int time = now() - start;
+    free(game);
+
+    char move[6] = { from.file + 'a', from.rank + '1', to.file + 'a', to.rank + '1' };
+    switch (promotion) {
+    case KNIGHT: move[4] = 'n'; break;
+    case BISHOP: move[4] = 'b'; break;
+    case ROOK:   move[4] = 'r'; break;
+    case QUEEN:  move[4] = 'q'; break;
+    }
+    printf("score %d, move %s, %d leaves, %d ms\n", score, move, perft, time);
+    if (strcmp(move, move_expected) == 0 &&
+            (limits.move_time == 0 || time <= limits.move_time + 50) &&
+            (limits.time == 0 || time <= limits.time / 2 + 50)) {
+        log_notice("A search test passed.");
+        return 0;
+    } else {
+        log_err("A search test of '%s' failed: expected %s, actual is %s in %d ms.",
+                fen, move_expected, move, time);
+        return -1;
+    }
+}
+
+// the deterministic parallel search finds the same with one thread and many
+int test_deterministic(const char *fen, int depth, int thread_count)
+{
+    struct game *game = load_fen(fen);
+    if (game == NULL)
+        return -1;
+    struct history history;
+    start_history(game, &history);
+    struct search_limits limits = { .depth = depth };
+    struct square from[2], to[2];
+    enum piece promotion[2];
+    int score[2], leaves[2];
+    enum parallel_mode mode = parallel_mode;
+    parallel_mode = PARALLEL_DETERMINISTIC;
+    for (int i = 0; i < 2; i++) {
+        set_threads(i == 0 ? 1 : thread_count);
+        tt_clear();
+        score[i] = think(game, &limits, &from[i], &to[i], &promotion[i]);
+        leaves[i] = perft;
+    }
+    set_threads(1);
+    parallel_mode = mode;
+    free(game);
+
+    if (score[0] == score[1] && leaves[0] == leaves[1] && from[0].file == from[1].file &&
+            from[0].rank == from[1].rank && to[0].file == to[1].file &&
+            to[0].rank == to[1].rank && promotion[0] == promotion[1]) {
+        log_notice("A deterministic search test passed.");
+        return 0;
+    } else {
+        log_err("A deterministic search test of '%s' failed: score %d and %d, %d and %d leaves.",
+                fen, score[0], score[1], leaves[0], leaves[1]);
+        return -1;
+    }
+}
+
+// Check the order the picker hands the moves out in: the table move,
+// the winning captures by the victim, the killers, then the rest, each move once
+int test_picker()
+{
+    struct game *game = load_fen("r3k2r/p1ppqpb1/bn2pnp1/3PN3/1p2P3/2N2Q1p/PPPBBPPP/R3K2R w KQkq - 0 1");
+    if (game == NULL)
+        return -1;
+    static struct heuristics heuristics;
+    clear_heuristics(&heuristics);
+    encoded_move tt_move = encode_move(4, 3, MOVE_NORMAL); // Kd1
+    encoded_move killer = encode_move(0, 1, MOVE_NORMAL); // Rb1
+    heuristics.killers[0][0] = killer;
+
+    struct move_picker picker;
+    init_picker(&picker, game, &heuristics, tt_move, 0, LEGAL);
+    encoded_move moves[MAX_MOVES];
+    int count = 0;
+    encoded_move m;
+    while ((m = next_move(&picker)) != NO_MOVE)
+        moves[count++] = m;
+
+    struct move_list list;
+    generate_moves(game, &list, LEGAL);
+    bool passed = count == list.count && moves[0] == tt_move;
+    for (int j = 0; j < count; j++) {
+        int found = 0;
+        for (int k = 0; k < count; k++)
+            found += list.moves[k] == moves[j];
+        for (int k = 0; k < j; k++)
+            passed = passed && moves[k] != moves[j];
+        passed = passed && found == 1;
+    }
+    int victim = QUEEN;
+    int i = 1;
+    for (; i < count && is_capture(game, moves[i]); i++) {
+        enum piece captured = game->mailbox[move_to(moves[i])] & PIECE_TYPE;
+        passed = passed && captured <= victim;
+        victim = captured;
+    }
+    passed = passed && i > 1 && moves[i] == killer;
+    free(game);
+
+    if (passed) {
+        log_notice("A move picker test passed.");
+        return 0;
+    } else {
+        log_err("A move picker test failed.");
+        return -1;
+    }
+}
+
+// Check the static exchange evaluation of a move against the thresholds
+// just meeting and just missing its expected value
+int test_see(const char *fen, const char *move, int value_expected)
+{
+    struct game *game = load_fen(fen);
+    if (game == NULL)
+        return -1;
+    encoded_move m = encode_move((move[1] - '1') * 8 + move[0] - 'a',
+                                 (move[3] - '1') * 8 + move[2] - 'a', MOVE_NORMAL);
+    bool meets = see(game, m, value_expected);
+    bool misses = !see(game, m, value_expected + 1);
+    free(game);
+    if (meets && misses) {
+        log_notice("A SEE test passed.");
+        return 0;
+    } else {
+        log_err("A SEE test of %s in '%s' failed: %s %d.", move, fen,
+                meets ? "exceeds" : "falls short of", value_expected);
+        return -1;
+    }
+}
+
+// Store entries in the transposition table and read them back
+int test_tt()
+{
+    uint64_t key = 0x123456789ABCDEF0ULL;
+    encoded_move m = encode_move(12, 28, MOVE_NORMAL);
+    struct tt_data data;
+    tt_clear();
+    tt_store(key, m, -199990, 7, BOUND_LOWER);
+    bool stored = tt_probe(key, &data) && data.move == m && data.score == -199990 &&
+            data.depth == 7 && data.bound == BOUND_LOWER;
+
+    // a torn write must not be taken for the position
+    struct tt_entry *entry = &tt_bucket(key)->entries[0];
+    atomic_store(&entry->data, atomic_load(&entry->data) ^ 1);
+    bool verified = !tt_probe(key, &data);
+
+    // a shallow result does not replace a deep one of the same search
+    tt_store(key, m, 100, 9, BOUND_EXACT);
+    tt_store(key, NO_MOVE, -50, 1, BOUND_UPPER);
+    bool kept = tt_probe(key, &data) && data.depth == 9 && data.score == 100;
+    tt_clear();
+
+    if (stored && verified && kept) {
+        log_notice("A transposition table test passed.");
+        return 0;
+    } else {
+        log_err("A transposition table test failed: stored %d, verified %d, kept %d.",
+                stored, verified, kept);
+        return -1;
+    }
+}
+
 int test_uci(const char *test_name, int commands_expected)
 {
     printf("Running test '%s'\n", test_name);
@@ -111,6 +410,34 @@ int test_uci(const char *test_name, int commands_expected)
     }
 }
 
+// a margin option sets the margin of its depth, values out of range are ignored
+int test_margin_options()
+{
+    struct game game = setup;
+    int saved[FUTILITY_DEPTH + 1];
+    memcpy(saved, futility_margins, sizeof saved);
+
+    char set[] = "setoption name Futility Margin 2 value 1234\n";
+    char too_large[] = "setoption name Futility Margin 2 value 30000\n";
+    char no_such_depth[] = "setoption name Futility Margin 4 value 1000\n";
+    uci(&game, set);
+    bool passed = futility_margins[2] == 1234;
+    uci(&game, too_large);
+    passed = passed && futility_margins[2] == 1234;
+    uci(&game, no_such_depth);
+    passed = passed && futility_margins[1] == saved[1] && futility_margins[3] == saved[3];
+
+    memcpy(futility_margins, saved, sizeof saved);
+    if (passed) {
+        log_notice("A margin option test passed.");
+        return 0;
+    } else {
+        log_err("A margin option test failed: margins %d, %d, %d.", futility_margins[1],
+                futility_margins[2], futility_margins[3]);
+        return -1;
+    }
+}
+
 int test_all()
 {
     int result = 0;
@@ -134,13 +461,68 @@ int test_all()
 
     // UCI
     result -= test_uci("uci_basic", 5);
+    result -= test_uci("uci_stalemate", 3);
+    result -= test_margin_options();
 
     // perft
     struct game game = setup;
     result -= test_perft(&game, 0, 1);
     result -= test_perft(&game, 1, 20);
     result -= test_perft(&game, 2, 400);
-//    result -= test_perft(&game, 3, 8902);
+    result -= test_perft(&game, 3, 8902);
+    result -= test_perft_fen("rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1", 4, 197281);
+    result -= test_perft_fen("r3k2r/p1ppqpb1/bn2pnp1/3PN3/1p2P3/2N2Q1p/PPPBBPPP/R3K2R w KQkq - 0 1",
+            3, 97862);
+    result -= test_perft_fen("8/2p5/3p4/KP5r/1R3p1k/8/4P1P1/8 w - - 0 1", 5, 674624);
+    result -= test_perft_fen("r3k2r/Pppp1ppp/1b3nbN/nP6/BBP1P3/q4N2/Pp1P2PP/R2Q1RK1 w kq - 0 1",
+            4, 422333);
+    result -= test_perft_fen("rnbq1k1r/pp1Pbppp/2p5/8/2B5/8/PPP1NnPP/RNBQK2R w KQ - 1 8", 3, 62379);
+
+    // search
+    result -= test_tt();
+    result -= test_picker();
+    result -= test_see("1k1r4/1pp4p/p7/4p3/8/P5P1/1PP4P/2K1R3 w - - 0 1", "e1e5", 1000);
+    result -= test_see("1k1r3q/1ppn3p/p4b2/4p3/8/P2N2P1/1PP1R1BP/2K1Q3 w - - 0 1", "d3e5", -2000);
+    result -= test_see("4R3/2r3p1/5bk1/1p1r3p/p2PR1P1/P1BK1P2/1P6/8 b - - 0 1", "h5g4", 0);
+    result -= test_see("4q3/1p1pr1k1/1B2rp2/6p1/pp4P1/1P1R4/4K3/4Q3 w - - 0 1", "d3d7", -4000);
+    result -= test_search("6k1/5ppp/8/8/8/8/5PPP/3R2K1 w - - 0 1",
+            (struct search_limits){ .depth = 2 }, "d1d8");
+    result -= test_search("r1bqkb1r/pppp1ppp/2n2n2/4p2Q/2B1P3/8/PPPP1PPP/RNB1K1NR w KQkq - 4 4",
+            (struct search_limits){ .depth = 4 }, "h5f7");
+    result -= test_search("4k3/8/8/3q4/8/8/3R4/3RK3 w - - 0 1",
+            (struct search_limits){ .depth = 4 }, "d2d5");
+    // far behind, but mating: the quiet mate is not razored nor futility pruned
+    result -= test_search("r6k/6pp/7N/8/q7/qQ6/5PPP/6K1 w - - 0 1",
+            (struct search_limits){ .depth = 5 }, "b3g8");
+    // mate in five by checks, within depth 9 only with the check extension
+    result -= test_search("r5k1/6pp/8/6N1/8/8/4Q3/6K1 w - - 0 1",
+            (struct search_limits){ .depth = 9 }, "e2c4");
+    // the rook lift wins, deep enough for ProbCut in the tree below
+    result -= test_search("5rk1/1ppb3p/p1pb4/6q1/3P1p1r/2P1R2P/PP1BQ1P1/5RKN w - - 0 1",
+            (struct search_limits){ .depth = 7 }, "e3g3");
+    // the rook is defended, the knight is not
+    result -= test_search("7k/8/4p3/3r4/6n1/8/8/K2Q4 w - - 0 1",
+            (struct search_limits){ .depth = 1 }, "d1g4");
+    result -= test_search("r1bqkb1r/pppp1ppp/2n2n2/4p2Q/2B1P3/8/PPPP1PPP/RNB1K1NR w KQkq - 4 4",
+            (struct search_limits){ .move_time = 200 }, "h5f7");
+    // a nearly empty clock still limits the search
+    result -= test_search("r1bqkb1r/pppp1ppp/2n2n2/4p2Q/2B1P3/8/PPPP1PPP/RNB1K1NR w KQkq - 4 4",
+            (struct search_limits){ .time = 50 }, "h5f7");
+    // the last move before the time control still leaves time on the clock
+    result -= test_search("4k3/8/8/3q4/8/8/3R4/3RK3 w - - 0 1",
+            (struct search_limits){ .time = 400, .moves_to_go = 1 }, "d2d5");
+    // helper threads share the table and vote
+    set_threads(4);
+    result -= test_search("4k3/8/8/3q4/8/8/3R4/3RK3 w - - 0 1",
+            (struct search_limits){ .depth = 6 }, "d2d5");
+    set_threads(1);
+    // split points searched alike however the tasks are spread
+    result -= test_deterministic("r3k2r/p1ppqpb1/bn2pnp1/3PN3/1p2P3/2N2Q1p/PPPBBPPP/R3K2R w KQkq - 0 1",
+                                 8, 4);
+
+    // incremental hashing and attack maps
+    result -= test_incremental("r3k2r/p1ppqpb1/bn2pnp1/3PN3/1p2P3/2N2Q1p/PPPBBPPP/R3K2R w KQkq - 0 1", 3);
+    result -= test_incremental("r3k2r/Pppp1ppp/1b3nbN/nP6/BBP1P3/q4N2/Pp1P2PP/R2Q1RK1 w kq - 0 1", 3);
 
     if (result == 0)
         log_notice("--- All tests passed. ---");
@@ -0,0 +1,181 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "log.h"
+#include "tt.h"
+
+struct transposition_table tt;
+
+/*
+ * Entry data packed into 64 bits: the move in bits 0-15, the score in 16-47,
+ * the depth in 48-55, the bound in 56-57 and the age in 58-63.
+ * A stored bound is never BOUND_NONE, so zero data is an empty entry.
+ */
+uint64_t pack(encoded_move move, int score, int depth,
+        enum tt_bound bound, int age)
+{
+    return (uint64_t)move | (uint64_t)(uint32_t)score << 16 |
+            (uint64_t)(uint8_t)depth << 48 | (uint64_t)bound << 56 | (uint64_t)age << 58;
+}
+
+int packed_depth(uint64_t data)
+{
+    return (int8_t)(data >> 48);
+}
+
+enum tt_bound packed_bound(uint64_t data)
+{
+    return (data >> 56) & 3;
+}
+
+int packed_age(uint64_t data)
+{
+    return data >> 58;
+}
+
+/*
+ * Allocate a table of the given size in kilobytes, rounded down to a power
+ * of two buckets. Returns false and keeps the old table if out of memory.
+ * The tt_ functions work on the table shared by the search threads,
+ * the table_ ones on any table.
+ */
+bool table_resize(struct transposition_table *table, int kilobytes)
+{
+    uint64_t count = 1;
+    while (count * 2 * sizeof(struct tt_bucket) <= (uint64_t)kilobytes << 10)
+        count *= 2;
+
+    struct tt_bucket *buckets = aligned_alloc(sizeof(struct tt_bucket),
+                                              count * sizeof(struct tt_bucket));
+    if (buckets == NULL) {
+        log_err("No memory for a %d KB transposition table", kilobytes);
+        return false;
+    }
+    free(table->buckets);
+    table->buckets = buckets;
+    table->mask = count - 1;
+    table_clear(table);
+    return true;
+}
+
+void table_clear(struct transposition_table *table)
+{
+    memset(table->buckets, 0, (table->mask + 1) * sizeof(struct tt_bucket));
+    table->age = 0;
+}
+
+bool tt_resize(int megabytes)
+{
+    return table_resize(&tt, megabytes * 1024);
+}
+
+void tt_clear()
+{
+    table_clear(&tt);
+}
+
+/*
+ * Entries stored from now on are newer than the ones already stored.
+ * A table forgetting the older entries is as good as cleared, but for
+ * the age wrapping around, when it is cleared for real.
+ */
+void table_new_age(struct transposition_table *table)
+{
+    table->age = (table->age + 1) & 63;
+    if (table->forget_older && table->age == 0)
+        table_clear(table);
+}
+
+// Entries stored from now on are newer than the ones left by the previous search
+void tt_new_search()
+{
+    table_new_age(&tt);
+}
+
+// An entry holding nothing, or only what the table forgets
+static inline bool is_empty(const struct transposition_table *table, uint64_t data)
+{
+    return data == 0 || (table->forget_older && packed_age(data) != table->age);
+}
+
+// Find the position in the table. Returns false if it is not stored.
+bool table_probe(struct transposition_table *table, uint64_t key, struct tt_data *result)
+{
+    struct tt_entry *entries = table_bucket(table, key)->entries;
+    for (int i = 0; i < TT_BUCKET_SIZE; i++) {
+        uint64_t data = atomic_load_explicit(&entries[i].data, memory_order_relaxed);
+        uint64_t key_xor_data = atomic_load_explicit(&entries[i].key_xor_data,
+                                                     memory_order_relaxed);
+        if (is_empty(table, data) || (key_xor_data ^ data) != key)
+            continue;
+        result->move = data & 0xFFFF;
+        result->score = (int32_t)(data >> 16);
+        result->depth = packed_depth(data);
+        result->bound = packed_bound(data);
+        return true;
+    }
+    return false;
+}
+
+/*
+ * Store a search result. The position's own entry is refreshed unless it
+ * holds a much deeper result of the same search; otherwise an empty entry
+ * is taken, or the one with the least depth left by the oldest search.
+ */
+void table_store(struct transposition_table *table, uint64_t key, encoded_move move, int score,
+                 int depth, enum tt_bound bound)
+{
+    struct tt_entry *entries = table_bucket(table, key)->entries;
+    struct tt_entry *replace = NULL;
+    int replace_worth = 0;
+    for (int i = 0; i < TT_BUCKET_SIZE; i++) {
+        uint64_t data = atomic_load_explicit(&entries[i].data, memory_order_relaxed);
+        uint64_t key_xor_data = atomic_load_explicit(&entries[i].key_xor_data,
+                                                     memory_order_relaxed);
+        if (is_empty(table, data)) {
+            replace = &entries[i];
+            break;
+        }
+        if ((key_xor_data ^ data) == key) {
+            if (bound != BOUND_EXACT && packed_age(data) == table->age &&
+                    depth < packed_depth(data) - 2)
+                return;
+            if (move == NO_MOVE)
+                move = data & 0xFFFF; // keep the move known from earlier
+            replace = &entries[i];
+            break;
+        }
+        int worth = packed_depth(data) - 8 * ((table->age - packed_age(data)) & 63);
+        if (replace == NULL || worth < replace_worth) {
+            replace = &entries[i];
+            replace_worth = worth;
+        }
+    }
+
+    uint64_t data = pack(move, score, depth, bound, table->age);
+    atomic_store_explicit(&replace->key_xor_data, key ^ data, memory_order_relaxed);
+    atomic_store_explicit(&replace->data, data, memory_order_relaxed);
+}
+
+bool tt_probe(uint64_t key, struct tt_data *result)
+{
+    return table_probe(&tt, key, result);
+}
+
+void tt_store(uint64_t key, encoded_move move, int score, int depth, enum tt_bound bound)
+{
+    table_store(&tt, key, move, score, depth, bound);
+}
+
+// Per mille of the table used by the current search, estimated by a sample
+int tt_hashfull()
+{
+    int used = 0;
+    for (int i = 0; i < 1000 / TT_BUCKET_SIZE; i++)
+    for (int j = 0; j < TT_BUCKET_SIZE; j++) {
+        uint64_t data = atomic_load_explicit(&tt.buckets[i].entries[j].data,
+                                             memory_order_relaxed);
+        used += data != 0 && packed_age(data) == tt.age;
+    }
+    return used;
+}
@@ -0,0 +1,82 @@
+#ifndef TT_H
+#define TT_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "game.h"
+
+enum tt_bound {
+    BOUND_NONE  = 0,
+    BOUND_UPPER = 1, // fail-low, the score is at most this
+    BOUND_LOWER = 2, // fail-high, the score is at least this
+    BOUND_EXACT = BOUND_UPPER|BOUND_LOWER,
+};
+
+/*
+ * A transposition table entry: the packed data and the Zobrist key XOR-ed
+ * with it. Threads read and write the two words without locks; an entry torn
+ * by a concurrent write does not verify and is treated as empty.
+ */
+struct tt_entry {
+    _Atomic uint64_t key_xor_data;
+    _Atomic uint64_t data;
+};
+
+// Entries sharing a cache line; a key may be stored in any of them
+#define TT_BUCKET_SIZE 4
+
+struct tt_bucket {
+    struct tt_entry entries[TT_BUCKET_SIZE];
+} __attribute__((aligned(64)));
+
+// What a probe finds out about a position
+struct tt_data {
+    encoded_move move; // best or refutation move, NO_MOVE if not known
+    int score;
+    int depth;
+    enum tt_bound bound;
+};
+
+#define TT_DEFAULT_SIZE 16 // megabytes
+
+struct transposition_table {
+    struct tt_bucket *buckets;
+    uint64_t mask; // number of buckets minus one, a power of two
+    uint8_t age; // search generation, distinguishes old entries
+    bool forget_older; // entries of the older ages count as empty
+};
+
+extern struct transposition_table tt;
+
+bool table_resize(struct transposition_table *table, int kilobytes);
+void table_clear(struct transposition_table *table);
+void table_new_age(struct transposition_table *table);
+bool table_probe(struct transposition_table *table, uint64_t key, struct tt_data *data);
+void table_store(struct transposition_table *table, uint64_t key, encoded_move move, int score,
+                 int depth, enum tt_bound bound);
+bool tt_resize(int megabytes);
+void tt_clear();
+void tt_new_search();
+bool tt_probe(uint64_t key, struct tt_data *data);
+void tt_store(uint64_t key, encoded_move move, int score, int depth, enum tt_bound bound);
+int tt_hashfull();
+
+static inline struct tt_bucket* table_bucket(const struct transposition_table *table, uint64_t key)
+{
+    return &table->buckets[key & table->mask];
+}
+
+static inline struct tt_bucket* tt_bucket(uint64_t key)
+{
+    return table_bucket(&tt, key);
+}
+
+// Start loading the bucket of a position into the cache before it is probed
+static inline void tt_prefetch(uint64_t key)
+{
+    __builtin_prefetch(tt_bucket(key));
+}
+
+#endif // TT_H
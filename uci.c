@@ -4,15 +4,22 @@
 #include <string.h>
 
 #include "ai.h"
+#include "tt.h"
 
 const char delimiters[]  = " \t\r\n";
 const size_t buffer_size = 256; // TODO: make dynamic
 
+// by enum parallel_mode
+const char *parallel_mode_names[] = { "LazySMP", "WorkStealing", "Deterministic" };
+
+struct history game_history; // positions of the game set by the last position command
+
 void uci_position(struct game *game, char *command)
 {
     // input command is now like:
     // position\0startpos moves e2e4
     struct game new_game;
+    struct history new_history;
     command += sizeof "position"; // skip "position\0"
     while (strchr(delimiters, command[0])) // skip whitespaces
         command++;
@@ -33,6 +40,7 @@ void uci_position(struct game *game, char *command)
         new_game = *fen_game;
         free(fen_game);
     }
+    start_history(&new_game, &new_history);
 
     // load moves
     if (moves != NULL) {
@@ -43,11 +51,39 @@ void uci_position(struct game *game, char *command)
                 return;
     }
 
+    game_history = new_history;
+    new_game.history = &game_history;
     *game = new_game;
 }
 
+// info line of a completed iteration, the score in centipawns or moves to mate
+void uci_report(int depth, int score, long long nodes, long long time,
+                const encoded_move *pv, int pv_length)
+{
+    printf("info depth %d score ", depth);
+    int mate_plies = value_king - abs(score);
+    if (mate_plies <= MAX_PLY)
+        printf("mate %d", score > 0 ? (mate_plies + 1) / 2 : -(mate_plies + 1) / 2);
+    else
+        printf("cp %d", score * 100 / value_pawn);
+    printf(" nodes %lld time %lld nps %lld hashfull %d pv", nodes, time,
+           nodes * 1000 / (time > 0 ? time : 1), tt_hashfull());
+    for (int i = 0; i < pv_length; i++) {
+        struct square from = index_square(move_from(pv[i]));
+        struct square to = index_square(move_to(pv[i]));
+        printf(" %c%d%c%d", from.file + 'a', from.rank + 1, to.file + 'a', to.rank + 1);
+        enum piece promotion = move_promotion(pv[i]);
+        if (promotion != EMPTY)
+            putchar(promotion == KNIGHT ? 'n' : promotion == BISHOP ? 'b' :
+                    promotion == ROOK ? 'r' : 'q');
+    }
+    putchar('\n');
+    fflush(stdout);
+}
+
 void uci_go(struct game *game, char *command)
 {
+    struct search_limits limits = { 0 };
     char *token;
     while (token = strtok(NULL, delimiters)) {
         if (strcmp(token, "searchmoves") == 0) {
@@ -58,50 +94,56 @@ void uci_go(struct game *game, char *command)
             //not supported
 
         } else if (strcmp(token, "wtime") == 0) {
-            //not supported
-            break;
+            if ((token = strtok(NULL, delimiters)) && game->side_to_move == WHITE)
+                limits.time = atoi(token);
 
         } else if (strcmp(token, "btime") == 0) {
-            //not supported
-            break;
+            if ((token = strtok(NULL, delimiters)) && game->side_to_move == BLACK)
+                limits.time = atoi(token);
 
         } else if (strcmp(token, "winc") == 0) {
-            //not supported
-            break;
+            if ((token = strtok(NULL, delimiters)) && game->side_to_move == WHITE)
+                limits.increment = atoi(token);
 
         } else if (strcmp(token, "binc") == 0) {
-            //not supported
-            break;
+            if ((token = strtok(NULL, delimiters)) && game->side_to_move == BLACK)
+                limits.increment = atoi(token);
 
         } else if (strcmp(token, "movestogo") == 0) {
-            //not supported
-            break;
+            if (token = strtok(NULL, delimiters))
+                limits.moves_to_go = atoi(token);
 
         } else if (strcmp(token, "depth") == 0) {
-            //not supported
-            break;
+            if (token = strtok(NULL, delimiters))
+                limits.depth = atoi(token);
 
         } else if (strcmp(token, "nodes") == 0) {
-            //not supported
-            break;
+            if (token = strtok(NULL, delimiters))
+                limits.nodes = atoll(token);
 
         } else if (strcmp(token, "mate") == 0) {
             //not supported
             break;
 
         } else if (strcmp(token, "movetime") == 0) {
-            //not supported
-            break;
+            if (token = strtok(NULL, delimiters))
+                limits.move_time = atoi(token);
 
         } else if (strcmp(token, "infinite") == 0) {
-            //not supported
+            //not supported, "stop" is not read while searching
 
         }
     }
 
+    if (!has_legal_move(game)) {
+        puts("bestmove 0000"); // checkmated or stalemated, nothing to search
+        return;
+    }
+
     struct square from, to;
     enum piece promotion;
-    best_move(game, 2, &from, &to, &promotion);
+    report_iteration = uci_report;
+    think(game, &limits, &from, &to, &promotion);
     char move[6];
     sprintf(move, "%c%d%c%d ", from.file + 'a', from.rank + 1,
         to.file + 'a', to.rank + 1);
@@ -115,6 +157,86 @@ void uci_go(struct game *game, char *command)
     printf("bestmove %s\n", move);
 }
 
+/*
+ * Pruning margins exposed as options for tuning, one per depth,
+ * e.g. "Futility Margin 2"
+ */
+struct margin_option {
+    const char *name;
+    int *margins; // by depth, from 1
+    int max_depth;
+} margin_options[] = {
+    { "Reverse Futility Margin", reverse_futility_margins, REVERSE_FUTILITY_DEPTH },
+    { "Futility Margin", futility_margins, FUTILITY_DEPTH },
+    { "Razoring Margin", razoring_margins, RAZORING_DEPTH },
+};
+
+const int margin_max = 20000;
+
+void print_margin_options()
+{
+    for (size_t i = 0; i < sizeof margin_options / sizeof *margin_options; i++)
+    for (int depth = 1; depth <= margin_options[i].max_depth; depth++)
+        printf("option name %s %d type spin default %d min 0 max %d\n", margin_options[i].name,
+                depth, margin_options[i].margins[depth], margin_max);
+}
+
+// Returns false if the name is not a margin option
+bool set_margin_option(const char *name, int value)
+{
+    for (size_t i = 0; i < sizeof margin_options / sizeof *margin_options; i++) {
+        size_t length = strlen(margin_options[i].name);
+        if (strncmp(name, margin_options[i].name, length) != 0 || name[length] != ' ')
+            continue;
+        int depth = atoi(name + length + 1);
+        if (depth >= 1 && depth <= margin_options[i].max_depth && value >= 0 &&
+                value <= margin_max)
+            margin_options[i].margins[depth] = value;
+        return true;
+    }
+    return false;
+}
+
+// setoption name <id> [value <x>]
+void uci_setoption(char *command)
+{
+    char name[buffer_size];
+    char *value = NULL;
+    char *token;
+    name[0] = '\0';
+    strtok(NULL, delimiters); // skip "name"
+    // the name may consist of several words
+    while ((token = strtok(NULL, delimiters)) && strcmp(token, "value") != 0) {
+        if (name[0] != '\0')
+            strcat(name, " ");
+        strcat(name, token);
+    }
+    if (token != NULL)
+        value = strtok(NULL, delimiters);
+    if (value == NULL)
+        return;
+
+    if (strcmp(name, "Hash") == 0) {
+        int megabytes = atoi(value);
+        if (megabytes >= 1 && megabytes <= 65536)
+            tt_resize(megabytes);
+    } else if (strcmp(name, "Move Overhead") == 0) {
+        int overhead = atoi(value);
+        if (overhead >= 0 && overhead <= 5000)
+            move_overhead = overhead;
+    } else if (strcmp(name, "Parallel Search") == 0) {
+        for (size_t i = 0; i < sizeof parallel_mode_names / sizeof *parallel_mode_names; i++)
+            if (strcmp(value, parallel_mode_names[i]) == 0)
+                parallel_mode = i;
+    } else if (strcmp(name, "Threads") == 0) {
+        int threads = atoi(value);
+        if (threads >= 1 && threads <= MAX_THREADS)
+            set_threads(threads);
+    } else {
+        set_margin_option(name, atoi(value));
+    }
+}
+
 // Returns true on quit command
 bool uci(struct game *game, char *command)
 {
@@ -126,6 +248,17 @@ bool uci(struct game *game, char *command)
         } else if (strcmp(token, "uci") == 0) {
             puts("id name Dharma Chess");
             puts("id author Dmitry Fedorkov"); 
+            printf("option name Hash type spin default %d min 1 max 65536\n", TT_DEFAULT_SIZE);
+            printf("option name Move Overhead type spin default %d min 0 max 5000\n",
+                    move_overhead);
+            // Each thread takes up to 2.7 MB with Work Stealing, 6.7 MB with
+            // Deterministic search, see MAX_NESTING
+            printf("option name Threads type spin default 1 min 1 max %d\n", MAX_THREADS);
+            printf("option name Parallel Search type combo default %s var %s var %s var %s\n",
+                    parallel_mode_names[parallel_mode], parallel_mode_names[PARALLEL_LAZY_SMP],
+                    parallel_mode_names[PARALLEL_WORK_STEALING],
+                    parallel_mode_names[PARALLEL_DETERMINISTIC]);
+            print_margin_options();
             puts("uciok"); 
 
         } else if (strcmp(token, "debug") == 0) {
@@ -135,13 +268,13 @@ bool uci(struct game *game, char *command)
             puts("readyok");
 
         } else if (strcmp(token, "setoption") == 0) {
-            // no options supported
+            uci_setoption(command);
 
         } else if (strcmp(token, "register") == 0) {
             // no registration
 
         } else if (strcmp(token, "ucinewgame") == 0) {
-            // do nothing
+            tt_clear();
 
         } else if (strcmp(token, "position") == 0) {
             uci_position(game, command);